@@ -0,0 +1,394 @@
+/*
+ *  Drift under load benchmark for the OpenBSD VMM control interface
+ *  driver.
+ *
+ *  Copyright 2019 Dave Voutila
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Polls a vmmci device's drift for a while, optionally under CPU, I/O and
+ * timer load, and writes every new drift sample and clock step to CSV:
+ *
+ *	elapsed_ns,event,offset_ns,delay_ns,host_ns,samples,sync_runs
+ *
+ * elapsed_ns is CLOCK_MONOTONIC since the start, event is "sample" for a
+ * new drift measurement or "step" when the driver ran a clock sync. At
+ * the end it prints the p50/p99/max of |offset| and delay, and how long
+ * each excursion past the threshold (e.g. after a host suspend) took to
+ * come back under it.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NSEC_PER_USEC	((int64_t) 1000)
+#define NSEC_PER_MSEC	((int64_t) 1000000)
+#define NSEC_PER_SEC	((int64_t) 1000000000)
+
+#define IO_BLOCK	(64 * 1024)
+#define IO_FILE_MAX	(64 * 1024 * 1024)
+
+struct drift {
+	int64_t offset;
+	int64_t delay;
+	int64_t time;
+	uint64_t samples;
+};
+
+/* A growable array of values to take percentiles of */
+struct series {
+	int64_t *v;
+	size_t len;
+	size_t cap;
+};
+
+static atomic_int stop;
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void on_signal(int sig)
+{
+	(void) sig;
+	atomic_store(&stop, 1);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	    "usage: %s [-d seconds] [-i interval_ms] [-D device] [-o csv]\n"
+	    "       [-c cpu_threads] [-I io_threads] [-t timer_threads]\n"
+	    "       [-w io_dir] [-T threshold_us]\n", prog);
+	exit(2);
+}
+
+static int read_file(const char *path, char *buf, size_t len)
+{
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	n = read(fd, buf, len - 1);
+	close(fd);
+	if (n < 0)
+		return -errno;
+	buf[n] = '\0';
+	return 0;
+}
+
+static int read_drift(const char *path, struct drift *d)
+{
+	char buf[128];
+	int rc;
+
+	rc = read_file(path, buf, sizeof(buf));
+	if (rc)
+		return rc;
+	if (sscanf(buf, "%" SCNd64 " %" SCNd64 " %" SCNd64 " %" SCNu64,
+	    &d->offset, &d->delay, &d->time, &d->samples) != 4)
+		return -EINVAL;
+	return 0;
+}
+
+static int read_u64(const char *path, uint64_t *val)
+{
+	char buf[32];
+	int rc;
+
+	rc = read_file(path, buf, sizeof(buf));
+	if (rc)
+		return rc;
+	if (sscanf(buf, "%" SCNu64, val) != 1)
+		return -EINVAL;
+	return 0;
+}
+
+static void series_add(struct series *s, int64_t val)
+{
+	if (s->len == s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 1024;
+		s->v = realloc(s->v, s->cap * sizeof(*s->v));
+		if (!s->v) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	s->v[s->len++] = val;
+}
+
+static int cmp_s64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest rank, on a sorted series */
+static int64_t series_pct(const struct series *s, int pct)
+{
+	size_t rank;
+
+	if (!s->len)
+		return 0;
+	rank = (s->len * pct + 99) / 100;
+	return s->v[rank ? rank - 1 : 0];
+}
+
+static void series_report(const char *name, struct series *s)
+{
+	qsort(s->v, s->len, sizeof(*s->v), cmp_s64);
+	fprintf(stderr, "%-8s n %zu p50_ns %" PRId64 " p99_ns %" PRId64
+	    " max_ns %" PRId64 "\n", name, s->len, series_pct(s, 50),
+	    series_pct(s, 99), s->len ? s->v[s->len - 1] : 0);
+}
+
+/* Load generators, each runs until stop is set */
+
+static void *cpu_load(void *arg)
+{
+	volatile uint64_t x = (uintptr_t) arg;
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		for (int i = 0; i < 100000; i++)
+			x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+	}
+	return NULL;
+}
+
+static void *io_load(void *arg)
+{
+	const char *dir = arg;
+	char path[4096];
+	char *buf;
+	off_t pos = 0;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/vmmci_bench.XXXXXX", dir);
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror(path);
+		return NULL;
+	}
+	unlink(path);
+
+	buf = malloc(IO_BLOCK);
+	if (!buf) {
+		close(fd);
+		return NULL;
+	}
+	memset(buf, 0xa5, IO_BLOCK);
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		if (pwrite(fd, buf, IO_BLOCK, pos) != IO_BLOCK) {
+			perror("pwrite");
+			break;
+		}
+		fdatasync(fd);
+		pos = (pos + IO_BLOCK) % IO_FILE_MAX;
+	}
+
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+static void *timer_load(void *arg)
+{
+	struct timespec ts = { 0, 50 * NSEC_PER_USEC };
+
+	(void) arg;
+	while (!atomic_load_explicit(&stop, memory_order_relaxed))
+		clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+	return NULL;
+}
+
+static pthread_t *start_load(void *(*fn)(void *), int n, void *arg)
+{
+	pthread_t *threads;
+
+	threads = calloc(n ? n : 1, sizeof(*threads));
+	if (!threads) {
+		perror("calloc");
+		exit(1);
+	}
+	for (int i = 0; i < n; i++) {
+		if (pthread_create(&threads[i], NULL, fn, arg)) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(1);
+		}
+	}
+	return threads;
+}
+
+static void stop_load(pthread_t *threads, int n)
+{
+	for (int i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+int main(int argc, char **argv)
+{
+	const char *device = "virtio0", *csv = NULL, *io_dir = "/tmp";
+	int duration = 60, interval_ms = 10, threshold_us = 1000;
+	int cpu_threads = 0, io_threads = 0, timer_threads = 0;
+	char drift_path[256], runs_path[256];
+	pthread_t *cpu, *io, *timer;
+	struct series offsets = { 0 }, delays = { 0 }, converge = { 0 };
+	struct drift d, last = { 0 };
+	uint64_t runs = 0, last_runs = 0;
+	int64_t start, end, excursion = -1, peak = 0;
+	struct timespec interval;
+	int excursions = 0;
+	FILE *out = stdout;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:i:D:o:c:I:t:w:T:h")) != -1) {
+		switch (opt) {
+		case 'd': duration = atoi(optarg); break;
+		case 'i': interval_ms = atoi(optarg); break;
+		case 'D': device = optarg; break;
+		case 'o': csv = optarg; break;
+		case 'c': cpu_threads = atoi(optarg); break;
+		case 'I': io_threads = atoi(optarg); break;
+		case 't': timer_threads = atoi(optarg); break;
+		case 'w': io_dir = optarg; break;
+		case 'T': threshold_us = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (duration <= 0 || interval_ms <= 0 || threshold_us <= 0
+	    || cpu_threads < 0 || io_threads < 0 || timer_threads < 0)
+		usage(argv[0]);
+
+	/* Prefer the device's own attributes, fall back to the sysctls */
+	snprintf(drift_path, sizeof(drift_path),
+	    "/sys/bus/virtio/devices/%s/drift", device);
+	snprintf(runs_path, sizeof(runs_path),
+	    "/sys/bus/virtio/devices/%s/sync_runs", device);
+	if (access(drift_path, R_OK)) {
+		snprintf(drift_path, sizeof(drift_path), "/proc/sys/vmmci/drift");
+		snprintf(runs_path, sizeof(runs_path), "/proc/sys/vmmci/sync_runs");
+	}
+	if (read_drift(drift_path, &last) || read_u64(runs_path, &last_runs)) {
+		fprintf(stderr, "can't read the drift from %s, is virtio_vmmci "
+		    "loaded?\n", drift_path);
+		return 1;
+	}
+
+	if (csv) {
+		out = fopen(csv, "w");
+		if (!out) {
+			perror(csv);
+			return 1;
+		}
+	}
+	fprintf(out, "elapsed_ns,event,offset_ns,delay_ns,host_ns,samples,"
+	    "sync_runs\n");
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	cpu = start_load(cpu_load, cpu_threads, NULL);
+	io = start_load(io_load, io_threads, (void *) io_dir);
+	timer = start_load(timer_load, timer_threads, NULL);
+
+	interval.tv_sec = interval_ms / 1000;
+	interval.tv_nsec = (interval_ms % 1000) * NSEC_PER_MSEC;
+	start = now_ns();
+	end = start + duration * NSEC_PER_SEC;
+
+	while (!atomic_load(&stop) && now_ns() < end) {
+		int64_t t, abs_offset;
+
+		clock_nanosleep(CLOCK_MONOTONIC, 0, &interval, NULL);
+		if (read_drift(drift_path, &d) || read_u64(runs_path, &runs))
+			continue;
+		t = now_ns() - start;
+
+		if (runs != last_runs) {
+			fprintf(out, "%" PRId64 ",step,%" PRId64 ",%" PRId64 ",%"
+			    PRId64 ",%" PRIu64 ",%" PRIu64 "\n", t, d.offset,
+			    d.delay, d.time, d.samples, runs);
+			last_runs = runs;
+		}
+		if (d.samples == last.samples)
+			continue;
+		last = d;
+
+		fprintf(out, "%" PRId64 ",sample,%" PRId64 ",%" PRId64 ",%"
+		    PRId64 ",%" PRIu64 ",%" PRIu64 "\n", t, d.offset, d.delay,
+		    d.time, d.samples, runs);
+
+		abs_offset = d.offset < 0 ? -d.offset : d.offset;
+		series_add(&offsets, abs_offset);
+		series_add(&delays, d.delay);
+
+		/* An excursion runs from the first sample over the threshold
+		 * to the first one back under it. */
+		if (abs_offset > threshold_us * NSEC_PER_USEC) {
+			if (excursion < 0) {
+				excursion = t;
+				peak = 0;
+				excursions++;
+			}
+			if (abs_offset > peak)
+				peak = abs_offset;
+		} else if (excursion >= 0) {
+			series_add(&converge, t - excursion);
+			fprintf(stderr, "converged after %" PRId64 " ms (peak %"
+			    PRId64 " ns)\n", (t - excursion) / NSEC_PER_MSEC,
+			    peak);
+			excursion = -1;
+		}
+	}
+	atomic_store(&stop, 1);
+
+	stop_load(cpu, cpu_threads);
+	stop_load(io, io_threads);
+	stop_load(timer, timer_threads);
+	if (out != stdout)
+		fclose(out);
+
+	series_report("offset", &offsets);
+	series_report("delay", &delays);
+	series_report("converge", &converge);
+	fprintf(stderr, "excursions %d (%s)\n", excursions,
+	    excursion >= 0 ? "last one never converged" : "all converged");
+
+	free(offsets.v);
+	free(delays.v);
+	free(converge.v);
+	return excursion >= 0;
+}
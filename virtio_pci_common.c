@@ -27,6 +27,33 @@
 #include "virtio_pci_common.h"
 #include "virtio_vmmci.h"
 
+/* the notify function used when creating a virt queue */
+bool vp_notify(struct virtqueue *vq)
+{
+	/* we write the queue's selector into the notification register to
+	 * signal the other end */
+	iowrite16(vq->index, (void __iomem *)vq->priv);
+	return true;
+}
+
+/* Notify all virtqueues on an interrupt. */
+static irqreturn_t vp_vring_interrupt(int irq, void *opaque)
+{
+	struct virtio_pci_device *vp_dev = opaque;
+	struct virtio_pci_vq_info *info;
+	irqreturn_t ret = IRQ_NONE;
+	unsigned long flags;
+
+	spin_lock_irqsave(&vp_dev->lock, flags);
+	list_for_each_entry(info, &vp_dev->virtqueues, node) {
+		if (vring_interrupt(irq, info->vq) == IRQ_HANDLED)
+			ret = IRQ_HANDLED;
+	}
+	spin_unlock_irqrestore(&vp_dev->lock, flags);
+
+	return ret;
+}
+
 /* Handle a configuration change: Tell driver if it wants to know. */
 static irqreturn_t vp_config_changed(int irq, void *opaque)
 {
@@ -38,51 +65,363 @@ static irqreturn_t vp_config_changed(int irq, void *opaque)
 	return IRQ_HANDLED;
 }
 
+static void vp_hist_add(struct vp_hist *h, s64 ns)
+{
+	s64 max, old;
+	int b = 0;
+
+	if (ns < 0)
+		ns = 0;
+	if (ns > 0)
+		b = min_t(int, fls64(ns) - 1, VP_HIST_BUCKETS - 1);
+
+	atomic64_inc(&h->buckets[b]);
+	atomic64_inc(&h->count);
+	atomic64_add(ns, &h->sum);
+
+	max = atomic64_read(&h->max);
+	while (ns > max) {
+		old = atomic64_cmpxchg(&h->max, max, ns);
+		if (old == max)
+			break;
+		max = old;
+	}
+}
+
+/* Hands a config change to the driver, timed from when its interrupt
+ * came in, so the histogram covers the ISR read and the way into the
+ * driver's callback as well as the callback itself. */
+static void vp_config_changed_since(int irq, void *opaque, ktime_t start)
+{
+	struct virtio_pci_device *vp_dev = opaque;
+
+	vp_config_changed(irq, opaque);
+	vp_hist_add(&vp_dev->config_irq_hist,
+	    ktime_to_ns(ktime_sub(ktime_get(), start)));
+}
+
 /* A small wrapper to also acknowledge the interrupt when it's handled.
  * I really need an EIO hook for the vring so I can ack the interrupt once we
  * know that we'll be handling the IRQ but before we invoke the callback since
  * the callback may notify the host which results in the host attempting to
  * raise an interrupt that we would then mask once we acknowledged the
- * interrupt. */
+ * interrupt.
+ *
+ * The line is shared (with the virtio disk, usually), so check the ISR
+ * before doing anything else: it costs one port read, whereas assuming the
+ * interrupt is ours costs a config read and a command dispatch. */
 static irqreturn_t vp_interrupt(int irq, void *opaque)
 {
-	// printk(KERN_INFO "virtio_pci_common: vp_interrupt (%d)\n", irq);
-	vp_config_changed(irq, opaque);
+	struct virtio_pci_device *vp_dev = opaque;
+	ktime_t start = ktime_get();
+	u8 isr;
+
+	this_cpu_inc(vp_dev->irq_stats->seen);
+
+	/* reading the ISR has the effect of also clearing it so it's very
+	 * important to save off the value. */
+	isr = ioread8(vp_dev->isr);
+
+	/* It's definitely not us if the ISR was not high */
+	if (!isr) {
+		this_cpu_inc(vp_dev->irq_stats->none);
+		return IRQ_NONE;
+	}
+
+	/* Configuration change?  Tell driver if it wants to know. */
+	if (isr & VIRTIO_PCI_ISR_CONFIG)
+		vp_config_changed_since(irq, opaque, start);
+
+	vp_vring_interrupt(irq, opaque);
+	return IRQ_HANDLED;
+}
+
+/* The config vector, which the virtqueues share when the host only gave
+ * us the one. */
+static irqreturn_t vp_msix_config(int irq, void *opaque)
+{
+	struct virtio_pci_device *vp_dev = opaque;
+	ktime_t start = ktime_get();
 
+	this_cpu_inc(vp_dev->irq_stats->seen);
+	vp_config_changed_since(irq, opaque, start);
+	if (vp_dev->msix_vectors < 2)
+		vp_vring_interrupt(irq, opaque);
 	return IRQ_HANDLED;
 }
 
+/* The virtqueues' own vector, when the host gave us a second one */
+static irqreturn_t vp_msix_vqs(int irq, void *opaque)
+{
+	struct virtio_pci_device *vp_dev = opaque;
+	irqreturn_t ret;
+
+	this_cpu_inc(vp_dev->irq_stats->seen);
+	ret = vp_vring_interrupt(irq, opaque);
+	if (ret == IRQ_NONE)
+		this_cpu_inc(vp_dev->irq_stats->none);
+	return ret;
+}
+
+/* wait for pending irq handlers */
+void vp_synchronize_vectors(struct virtio_device *vdev)
+{
+	struct virtio_pci_device *vp_dev = to_vp_device(vdev);
+	int i;
+
+	if (vp_dev->intx_enabled)
+		synchronize_irq(vp_dev->pci_dev->irq);
+
+	for (i = 0; i < vp_dev->msix_vectors; ++i)
+		synchronize_irq(pci_irq_vector(vp_dev->pci_dev, i));
+}
+
+/* Try to get a dedicated MSI-X vector for configuration changes, so we
+ * aren't sharing the legacy line with other devices and the vector can be
+ * pinned to a cpu of our choosing via /proc/irq. A second one, if the
+ * host has it, is kept for the virtqueues (see vp_find_vqs). */
+static int vp_request_msix_config(struct virtio_pci_device *vp_dev)
+{
+	struct pci_dev *pci_dev = vp_dev->pci_dev;
+	int rc, nvectors;
+
+	nvectors = pci_alloc_irq_vectors(pci_dev, 1, 2, PCI_IRQ_MSIX);
+	if (nvectors < 0)
+		return nvectors;
+
+	vp_dev->msix_names = kmalloc_array(nvectors,
+	    sizeof(*vp_dev->msix_names), GFP_KERNEL);
+	if (!vp_dev->msix_names) {
+		rc = -ENOMEM;
+		goto err_names;
+	}
+	snprintf(vp_dev->msix_names[VP_MSIX_CONFIG_VECTOR],
+		 sizeof(*vp_dev->msix_names), "%s-config", pci_name(pci_dev));
+
+	rc = request_irq(pci_irq_vector(pci_dev, VP_MSIX_CONFIG_VECTOR),
+			 vp_msix_config, 0,
+			 vp_dev->msix_names[VP_MSIX_CONFIG_VECTOR], vp_dev);
+	if (rc)
+		goto err_irq;
+
+	/* The config space moves once MSI-X is on, so set this before
+	 * touching it again. */
+	vp_dev->msix_enabled = 1;
+	vp_dev->msix_vectors = nvectors;
+	vp_dev->msix_used_vectors = 1;
+
+	if (vp_dev->config_vector(vp_dev, VP_MSIX_CONFIG_VECTOR) ==
+	    VIRTIO_MSI_NO_VECTOR) {
+		rc = -EBUSY;
+		goto err_vector;
+	}
+
+	return 0;
+
+err_vector:
+	vp_dev->msix_enabled = 0;
+	vp_dev->msix_vectors = 0;
+	vp_dev->msix_used_vectors = 0;
+	free_irq(pci_irq_vector(pci_dev, VP_MSIX_CONFIG_VECTOR), vp_dev);
+err_irq:
+	kfree(vp_dev->msix_names);
+	vp_dev->msix_names = NULL;
+err_names:
+	pci_free_irq_vectors(pci_dev);
+	return rc;
+}
+
+/* Use MSI-X when the host offers it, otherwise the shared legacy line */
+static int vp_request_irq(struct virtio_pci_device *vp_dev)
+{
+	struct pci_dev *pci_dev = vp_dev->pci_dev;
+	int rc;
+
+	rc = vp_request_msix_config(vp_dev);
+	if (rc == 0)
+		return 0;
+
+	dev_info(&pci_dev->dev, "no MSI-X config vector (%d), using INTx\n", rc);
+
+	rc = request_irq(pci_dev->irq, vp_interrupt, IRQF_SHARED,
+	    dev_name(&vp_dev->vdev.dev), vp_dev);
+	if (rc)
+		return rc;
+
+	vp_dev->intx_enabled = 1;
+	return 0;
+}
+
+static void vp_free_irq(struct virtio_pci_device *vp_dev)
+{
+	struct pci_dev *pci_dev = vp_dev->pci_dev;
+
+	if (vp_dev->intx_enabled) {
+		free_irq(pci_dev->irq, vp_dev);
+		vp_dev->intx_enabled = 0;
+	}
+
+	if (vp_dev->msix_enabled) {
+		/* Disable the vector used for configuration */
+		vp_dev->config_vector(vp_dev, VIRTIO_MSI_NO_VECTOR);
+		free_irq(pci_irq_vector(pci_dev, VP_MSIX_CONFIG_VECTOR), vp_dev);
+		pci_free_irq_vectors(pci_dev);
+		kfree(vp_dev->msix_names);
+		vp_dev->msix_names = NULL;
+		vp_dev->msix_enabled = 0;
+		vp_dev->msix_vectors = 0;
+		vp_dev->msix_used_vectors = 0;
+	}
+}
+
+static struct virtqueue *vp_setup_vq(struct virtio_device *vdev, unsigned index,
+				     void (*callback)(struct virtqueue *vq),
+				     const char *name,
+				     bool ctx,
+				     u16 msix_vec)
+{
+	struct virtio_pci_device *vp_dev = to_vp_device(vdev);
+	struct virtio_pci_vq_info *info = kmalloc(sizeof *info, GFP_KERNEL);
+	struct virtqueue *vq;
+	unsigned long flags;
+
+	/* fill out our structure that represents an active queue */
+	if (!info)
+		return ERR_PTR(-ENOMEM);
+
+	vq = vp_dev->setup_vq(vp_dev, info, index, callback, name, ctx,
+			      msix_vec);
+	if (IS_ERR(vq)) {
+		kfree(info);
+		return vq;
+	}
+
+	info->vq = vq;
+	if (callback) {
+		spin_lock_irqsave(&vp_dev->lock, flags);
+		list_add(&info->node, &vp_dev->virtqueues);
+		spin_unlock_irqrestore(&vp_dev->lock, flags);
+	} else {
+		INIT_LIST_HEAD(&info->node);
+	}
+
+	vp_dev->vqs[index] = info;
+	return vq;
+}
+
+static void vp_del_vq(struct virtqueue *vq)
+{
+	struct virtio_pci_device *vp_dev = to_vp_device(vq->vdev);
+	struct virtio_pci_vq_info *info = vp_dev->vqs[vq->index];
+	unsigned long flags;
+
+	spin_lock_irqsave(&vp_dev->lock, flags);
+	list_del(&info->node);
+	spin_unlock_irqrestore(&vp_dev->lock, flags);
+
+	vp_dev->del_vq(info);
+	kfree(info);
+}
+
 /* the config->del_vqs() implementation */
 void vp_del_vqs(struct virtio_device *vdev)
 {
-	// XXX: we don't use queues!
+	struct virtio_pci_device *vp_dev = to_vp_device(vdev);
+	struct virtqueue *vq, *n;
+
+	list_for_each_entry_safe(vq, n, &vdev->vqs, list)
+		vp_del_vq(vq);
+
+	if (vp_dev->msix_used_vectors > VP_MSIX_VQ_VECTOR) {
+		free_irq(pci_irq_vector(vp_dev->pci_dev, VP_MSIX_VQ_VECTOR),
+			 vp_dev);
+		vp_dev->msix_used_vectors = VP_MSIX_VQ_VECTOR;
+	}
+
+	kfree(vp_dev->vqs);
+	vp_dev->vqs = NULL;
 }
 
+/* All the virtqueues share one interrupt: the vq vector with MSI-X if we
+ * got two vectors, else the config vector or the legacy line, which
+ * already dispatch to them. vmmci only has a queue or two, so per-vq
+ * vectors aren't worth it. */
+static int vp_find_vqs_shared(struct virtio_device *vdev, unsigned nvqs,
+			      struct virtqueue *vqs[],
+			      vq_callback_t *callbacks[],
+			      const char * const names[],
+			      const bool *ctx)
+{
+	struct virtio_pci_device *vp_dev = to_vp_device(vdev);
+	struct pci_dev *pci_dev = vp_dev->pci_dev;
+	u16 msix_vec = VIRTIO_MSI_NO_VECTOR;
+	int i, err, queue_idx = 0;
+
+	vp_dev->vqs = kcalloc(nvqs, sizeof(*vp_dev->vqs), GFP_KERNEL);
+	if (!vp_dev->vqs)
+		return -ENOMEM;
+
+	if (vp_dev->msix_enabled && vp_dev->msix_vectors > VP_MSIX_VQ_VECTOR) {
+		snprintf(vp_dev->msix_names[VP_MSIX_VQ_VECTOR],
+			 sizeof(*vp_dev->msix_names), "%s-virtqueues",
+			 pci_name(pci_dev));
+		err = request_irq(pci_irq_vector(pci_dev, VP_MSIX_VQ_VECTOR),
+				  vp_msix_vqs, 0,
+				  vp_dev->msix_names[VP_MSIX_VQ_VECTOR], vp_dev);
+		if (err)
+			goto error_find;
+		vp_dev->msix_used_vectors = VP_MSIX_VQ_VECTOR + 1;
+		msix_vec = VP_MSIX_VQ_VECTOR;
+	} else if (vp_dev->msix_enabled) {
+		msix_vec = VP_MSIX_CONFIG_VECTOR;
+	}
+
+	for (i = 0; i < nvqs; ++i) {
+		if (!names[i]) {
+			vqs[i] = NULL;
+			continue;
+		}
+
+		vqs[i] = vp_setup_vq(vdev, queue_idx++, callbacks[i], names[i],
+				     ctx ? ctx[i] : false,
+				     callbacks[i] ? msix_vec : VIRTIO_MSI_NO_VECTOR);
+		if (IS_ERR(vqs[i])) {
+			err = PTR_ERR(vqs[i]);
+			goto error_find;
+		}
+	}
+	return 0;
+
+error_find:
+	vp_del_vqs(vdev);
+	return err;
+}
+
+/* the config->find_vqs() implementation */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,11,0)
 int vp_find_vqs(struct virtio_device *vdev, unsigned nvqs,
     struct virtqueue *vqs[], vq_callback_t *callbacks[],
     const char * const names[])
 {
-	return 0;
+	return vp_find_vqs_shared(vdev, nvqs, vqs, callbacks, names, NULL);
 }
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0) && LINUX_VERSION_CODE < KERNEL_VERSION(4,12,0)
-int vp_find_vqs(struct virtio_device *, unsigned nvqs,
+int vp_find_vqs(struct virtio_device *vdev, unsigned nvqs,
     struct virtqueue *vqs[], vq_callback_t *callbacks[],
     const char * const names[], struct irq_affinity *desc)
 {
-	return 0;
+	return vp_find_vqs_shared(vdev, nvqs, vqs, callbacks, names, NULL);
 }
 #else
-/* the config->find_vqs() implementation */
 int vp_find_vqs(struct virtio_device *vdev, unsigned nvqs,
 		struct virtqueue *vqs[], vq_callback_t *callbacks[],
 		const char * const names[], const bool *ctx,
 		struct irq_affinity *desc)
 {
-	// XXX: we don't use queues!
-	return 0;
+	return vp_find_vqs_shared(vdev, nvqs, vqs, callbacks, names, ctx);
 }
 #endif
+
 const char *vp_bus_name(struct virtio_device *vdev)
 {
 	struct virtio_pci_device *vp_dev = to_vp_device(vdev);
@@ -107,7 +446,7 @@ int vp_set_vq_affinity(struct virtqueue *vq, int cpu)
 	if (!vq->callback)
 		return -EINVAL;
 
-	if (vp_dev->msix_enabled) {
+	if (vp_dev->msix_enabled && vp_dev->msix_affinity_masks) {
 		mask = vp_dev->msix_affinity_masks[info->msix_vector];
 		irq = pci_irq_vector(vp_dev->pci_dev, info->msix_vector);
 		if (cpu == -1)
@@ -137,7 +476,7 @@ int vp_set_vq_affinity(struct virtqueue *vq, const struct cpumask *cpu_mask)
 	if (!vq->callback)
 		return -EINVAL;
 
-	if (vp_dev->msix_enabled) {
+	if (vp_dev->msix_enabled && vp_dev->msix_affinity_masks) {
 		mask = vp_dev->msix_affinity_masks[info->msix_vector];
 		irq = pci_irq_vector(vp_dev->pci_dev, info->msix_vector);
 		if (!cpu_mask)
@@ -171,6 +510,92 @@ static const struct pci_device_id virtio_pci_id_table[] = {
 
 MODULE_DEVICE_TABLE(pci, virtio_pci_id_table);
 
+/* Attributes of the PCI device, kept here rather than in the vmmci driver
+ * so it doesn't have to know which transport it's on. The histogram is
+ * printed like the driver's debugfs ones, and writing resets it. */
+static ssize_t config_irq_latency_show(struct device *dev,
+				       struct device_attribute *attr, char *buf)
+{
+	struct virtio_pci_device *vp_dev = pci_get_drvdata(to_pci_dev(dev));
+	struct vp_hist *h = &vp_dev->config_irq_hist;
+	unsigned long long lo;
+	ssize_t len;
+	long long n;
+	int b;
+
+	len = scnprintf(buf, PAGE_SIZE, "count %lld sum_ns %lld max_ns %lld\n",
+	    (long long) atomic64_read(&h->count),
+	    (long long) atomic64_read(&h->sum),
+	    (long long) atomic64_read(&h->max));
+
+	for (b = 0; b < VP_HIST_BUCKETS; b++) {
+		n = atomic64_read(&h->buckets[b]);
+		if (!n)
+			continue;
+
+		lo = b ? 1ULL << b : 0;
+		if (b == VP_HIST_BUCKETS - 1)
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+			    "[%llu, inf) %lld\n", lo, n);
+		else
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+			    "[%llu, %llu) %lld\n", lo, 1ULL << (b + 1), n);
+	}
+
+	return len;
+}
+
+static ssize_t config_irq_latency_store(struct device *dev,
+					struct device_attribute *attr,
+					const char *buf, size_t count)
+{
+	struct virtio_pci_device *vp_dev = pci_get_drvdata(to_pci_dev(dev));
+	struct vp_hist *h = &vp_dev->config_irq_hist;
+	int b;
+
+	atomic64_set(&h->count, 0);
+	atomic64_set(&h->sum, 0);
+	atomic64_set(&h->max, 0);
+	for (b = 0; b < VP_HIST_BUCKETS; b++)
+		atomic64_set(&h->buckets[b], 0);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(config_irq_latency);
+
+/* Counted here rather than in the driver's callbacks, which never see
+ * the interrupts that weren't for the device. */
+static ssize_t irq_stats_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct virtio_pci_device *vp_dev = pci_get_drvdata(to_pci_dev(dev));
+	unsigned long seen = 0, none = 0;
+	struct vp_irq_counts *s;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		s = per_cpu_ptr(vp_dev->irq_stats, cpu);
+		seen += READ_ONCE(s->seen);
+		none += READ_ONCE(s->none);
+	}
+
+	return scnprintf(buf, PAGE_SIZE, "irqs %lu\nirqs_none %lu\n",
+	    seen, none);
+}
+
+static DEVICE_ATTR_RO(irq_stats);
+
+static struct attribute *vp_attrs[] = {
+	&dev_attr_config_irq_latency.attr,
+	&dev_attr_irq_stats.attr,
+	NULL,
+};
+
+static const struct attribute_group vp_attr_group = {
+	.attrs = vp_attrs,
+};
+
 static void virtio_pci_release_dev(struct device *_d)
 {
 	struct virtio_device *vdev = dev_to_virtio(_d);
@@ -179,6 +604,7 @@ static void virtio_pci_release_dev(struct device *_d)
 	/* As struct device is a kobject, it's not safe to
 	 * free the memory (including the reference counter itself)
 	 * until it's release callback. */
+	free_percpu(vp_dev->irq_stats);
 	kfree(vp_dev);
 }
 
@@ -192,6 +618,11 @@ static int virtio_pci_probe(struct pci_dev *pci_dev,
 	vp_dev = kzalloc(sizeof(struct virtio_pci_device), GFP_KERNEL);
 	if (!vp_dev)
 		return -ENOMEM;
+	vp_dev->irq_stats = alloc_percpu(struct vp_irq_counts);
+	if (!vp_dev->irq_stats) {
+		kfree(vp_dev);
+		return -ENOMEM;
+	}
 
 	pci_set_drvdata(pci_dev, vp_dev);
 	vp_dev->vdev.dev.parent = &pci_dev->dev;
@@ -199,6 +630,7 @@ static int virtio_pci_probe(struct pci_dev *pci_dev,
 	vp_dev->pci_dev = pci_dev;
 	INIT_LIST_HEAD(&vp_dev->virtqueues);
 	spin_lock_init(&vp_dev->lock);
+	spin_lock_init(&vp_dev->time_lock);
 
 	/* enable the device */
 	rc = pci_enable_device(pci_dev);
@@ -213,27 +645,33 @@ static int virtio_pci_probe(struct pci_dev *pci_dev,
 	pci_set_master(pci_dev);
 
 
-	rc = request_irq(pci_dev->irq, vp_interrupt, IRQF_SHARED,
-	    dev_name(&vp_dev->vdev.dev), vp_dev);
+	rc = vp_request_irq(vp_dev);
 	if (rc)
-		goto err_probe;
+		goto err_irq;
 
 	rc = register_virtio_device(&vp_dev->vdev);
 	reg_dev = vp_dev;
 	if (rc)
 		goto err_register;
 
+	if (sysfs_create_group(&pci_dev->dev.kobj, &vp_attr_group))
+		printk(KERN_WARNING "virtio_pci_obsd: failed to create sysfs attributes\n");
+
 	return 0;
 
 err_register:
+	vp_free_irq(vp_dev);
+err_irq:
 	virtio_pci_obsd_remove(vp_dev);
 err_probe:
 	pci_disable_device(pci_dev);
 err_enable_device:
-	if (reg_dev)
+	if (reg_dev) {
 		put_device(&vp_dev->vdev.dev);
-	else
+	} else {
+		free_percpu(vp_dev->irq_stats);
 		kfree(vp_dev);
+	}
 	return rc;
 }
 
@@ -244,12 +682,12 @@ static void virtio_pci_remove(struct pci_dev *pci_dev)
 
 	pci_disable_sriov(pci_dev);
 
+	sysfs_remove_group(&pci_dev->dev.kobj, &vp_attr_group);
 	unregister_virtio_device(&vp_dev->vdev);
 
-	virtio_pci_obsd_remove(vp_dev);
+	vp_free_irq(vp_dev);
 
-	// XXX: where should this go?
-	free_irq(pci_dev->irq, vp_dev);
+	virtio_pci_obsd_remove(vp_dev);
 
 	pci_disable_device(pci_dev);
 	put_device(dev);
@@ -262,16 +700,34 @@ static int virtio_pci_sriov_configure(struct pci_dev *pci_dev, int num_vfs)
 }
 
 #ifdef CONFIG_PM_SLEEP
+/* vmm(4) has no power management of its own, but the guest can still be
+ * suspended or hibernated, so hand it to the virtio driver like upstream's
+ * virtio_pci does.
+ */
 static int virtio_pci_freeze(struct device *dev)
 {
-	// XXX: vmm(4) does not support power management
-	return 0;
+	struct pci_dev *pci_dev = to_pci_dev(dev);
+	struct virtio_pci_device *vp_dev = pci_get_drvdata(pci_dev);
+	int rc;
+
+	rc = virtio_device_freeze(&vp_dev->vdev);
+	if (!rc)
+		pci_disable_device(pci_dev);
+	return rc;
 }
 
 static int virtio_pci_restore(struct device *dev)
 {
-	// XXX: vmm(4) does not support power management
-	return 0;
+	struct pci_dev *pci_dev = to_pci_dev(dev);
+	struct virtio_pci_device *vp_dev = pci_get_drvdata(pci_dev);
+	int rc;
+
+	rc = pci_enable_device(pci_dev);
+	if (rc)
+		return rc;
+
+	pci_set_master(pci_dev);
+	return virtio_device_restore(&vp_dev->vdev);
 }
 
 static const struct dev_pm_ops virtio_pci_pm_ops = {
@@ -20,6 +20,8 @@
  */
 
 #include <linux/module.h>
+#include <linux/atomic.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/pci.h>
 #include <linux/slab.h>
@@ -30,8 +32,27 @@
 #include <linux/virtio_ring.h>
 #include <linux/virtio_pci.h>
 #include <linux/highmem.h>
+#include <linux/percpu.h>
 #include <linux/spinlock.h>
 
+/* Latency histogram in log2 buckets of nanoseconds, the same as the
+ * vmmci driver's: bucket n counts [2^n, 2^(n+1)), except that bucket 0
+ * also takes 0 and the last one everything above. */
+/* Per cpu, so the interrupt path doesn't bounce a cache line */
+struct vp_irq_counts {
+	unsigned long seen;	/* handler calls */
+	unsigned long none;	/* ...that weren't for us (IRQ_NONE) */
+};
+
+#define VP_HIST_BUCKETS	32
+
+struct vp_hist {
+	atomic64_t count;
+	atomic64_t sum;
+	atomic64_t max;
+	atomic64_t buckets[VP_HIST_BUCKETS];
+};
+
 struct virtio_pci_vq_info {
 	/* the actual virtqueue */
 	struct virtqueue *vq;
@@ -80,6 +101,21 @@ struct virtio_pci_device {
 	spinlock_t lock;
 	struct list_head virtqueues;
 
+	/* From a config change interrupt coming in to the driver's
+	 * callback returning, see the config_irq_latency attribute */
+	struct vp_hist config_irq_hist;
+	/* Handler calls and IRQ_NONEs, see the irq_stats attribute */
+	struct vp_irq_counts __percpu *irq_stats;
+
+	/* Serializes host time snapshots, which share the cached upper
+	 * half of the seconds below. */
+	spinlock_t time_lock;
+	/* Upper half of the host seconds, only re-read when the lower
+	 * half goes backwards. */
+	u32 time_sec_lo;
+	u32 time_sec_hi;
+	bool time_sec_hi_valid;
+
 	/* array of all queues for house-keeping */
 	struct virtio_pci_vq_info **vqs;
 
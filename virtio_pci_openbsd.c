@@ -26,6 +26,13 @@
  *  Dave Voutila <voutilad@gmail.com>
  */
 #include "virtio_pci_common.h"
+#include "virtio_vmmci.h"
+
+/* vmd(8) doesn't latch the clock, each register read samples it afresh,
+ * so a seconds/microseconds pair tears if the seconds roll over between
+ * the reads. Re-reading the seconds after the microseconds catches that
+ * however long we were held up in between. */
+#define VP_TIME_MAX_RETRIES		4
 
 /* virtio config->get_features() implementation */
 static u64 vp_get_features(struct virtio_device *vdev)
@@ -54,6 +61,73 @@ static int vp_finalize_features(struct virtio_device *vdev)
 	return 0;
 }
 
+/* One 32-bit time register. The KUnit suite replaces it with a scripted
+ * clock to make the reads tear on purpose.
+ */
+static u32 vp_time_read(void __iomem *config_addr, unsigned int offset)
+{
+	KUNIT_STATIC_STUB_REDIRECT(vp_time_read, config_addr, offset);
+
+	return ioread32(config_addr + offset);
+}
+
+/* Read the host clock with the fewest register accesses vmd(8) allows.
+ *
+ * vmd(8) exposes the host time as two 64-bit registers (seconds at
+ * VMMCI_CONFIG_TIME_SEC and microseconds at VMMCI_CONFIG_TIME_USEC), each
+ * read as two 32-bit halves. The microseconds never need their upper half
+ * and the upper half of the seconds only changes when the lower half wraps,
+ * so the common case is the seconds, the microseconds and the seconds again,
+ * three port reads instead of six.
+ */
+static void vp_get_time(struct virtio_pci_device *vp_dev,
+			void __iomem *config_addr,
+			struct vmmci_time_snapshot *snap)
+{
+	unsigned long flags;
+	u32 sec, sec2, usec;
+
+	snap->retries = 0;
+	snap->reads = 0;
+
+	spin_lock_irqsave(&vp_dev->time_lock, flags);
+
+	sec = vp_time_read(config_addr, VMMCI_CONFIG_TIME_SEC);
+	snap->reads++;
+	for (;;) {
+		usec = vp_time_read(config_addr, VMMCI_CONFIG_TIME_USEC);
+		sec2 = vp_time_read(config_addr, VMMCI_CONFIG_TIME_SEC);
+		snap->reads += 2;
+		if (sec2 == sec)
+			break;
+
+		// giving up, the microseconds probably go with the later
+		// seconds if they're small and the earlier ones if not
+		if (snap->retries >= VP_TIME_MAX_RETRIES) {
+			if (usec < USEC_PER_SEC / 2)
+				sec = sec2;
+			break;
+		}
+		sec = sec2;
+		snap->retries++;
+	}
+
+	// a wrap (or the host stepping its clock back) means the upper
+	// half may have changed, so go fetch it again
+	if (!vp_dev->time_sec_hi_valid || sec < vp_dev->time_sec_lo) {
+		vp_dev->time_sec_hi = vp_time_read(config_addr,
+		    VMMCI_CONFIG_TIME_SEC + sizeof(u32));
+		vp_dev->time_sec_hi_valid = true;
+		snap->reads++;
+	}
+	vp_dev->time_sec_lo = sec;
+
+	snap->sec = (s64) (((u64) vp_dev->time_sec_hi << 32) | sec);
+	snap->usec = usec;
+
+	spin_unlock_irqrestore(&vp_dev->time_lock, flags);
+}
+
 /* OpenBSD's vmmci does some funky stuff when reading registers, so the normal
    Linux legacy  vp_get won't work since it reads a byte at a time iterating
    over the registers.
@@ -69,6 +143,13 @@ static void vp_get(struct virtio_device *vdev, unsigned offset,
 	__le32 l;
 
 	BUG_ON(NULL == config_addr);
+
+	if (offset == VMMCI_CONFIG_TIME_SEC
+	    && len == sizeof(struct vmmci_time_snapshot)) {
+		vp_get_time(vp_dev, config_addr, buf);
+		return;
+	}
+
 	switch (len) {
 	case 1:
 		b = ioread8(config_addr + offset);
@@ -155,6 +236,11 @@ static void vp_reset(struct virtio_device *vdev)
 	/* Flush out the status write, and flush in device writes,
 	 * including MSi-X interrupts, if any. */
 	ioread8(vp_dev->ioaddr + VIRTIO_PCI_STATUS);
+	/* Flush pending VQ/configuration callbacks. */
+	vp_synchronize_vectors(vdev);
+	/* A reset forgets the config vector, so hand it back */
+	if (vp_dev->msix_enabled)
+		vp_dev->config_vector(vp_dev, VP_MSIX_CONFIG_VECTOR);
 }
 
 static u16 vp_config_vector(struct virtio_pci_device *vp_dev, u16 vector)
@@ -166,6 +252,9 @@ static u16 vp_config_vector(struct virtio_pci_device *vp_dev, u16 vector)
 	return ioread16(vp_dev->ioaddr + VIRTIO_MSI_CONFIG_VECTOR);
 }
 
+/* Legacy virtqueues, laid out the way vmd(8) expects: page aligned rings
+ * at a page frame number written to VIRTIO_PCI_QUEUE_PFN, with the queue
+ * size fixed by the host. */
 static struct virtqueue *setup_vq(struct virtio_pci_device *vp_dev,
 				  struct virtio_pci_vq_info *info,
 				  unsigned index,
@@ -174,13 +263,84 @@ static struct virtqueue *setup_vq(struct virtio_pci_device *vp_dev,
 				  bool ctx,
 				  u16 msix_vec)
 {
-	// XXX: not needed
-	return ERR_PTR(-ENOENT);
+	struct virtqueue *vq;
+	u16 num;
+	u64 q_pfn;
+	int err;
+
+	/* Select the queue we're interested in */
+	iowrite16(index, vp_dev->ioaddr + VIRTIO_PCI_QUEUE_SEL);
+
+	/* Check if queue is either not available or already active. */
+	num = ioread16(vp_dev->ioaddr + VIRTIO_PCI_QUEUE_NUM);
+	if (!num || ioread32(vp_dev->ioaddr + VIRTIO_PCI_QUEUE_PFN))
+		return ERR_PTR(-ENOENT);
+
+	info->msix_vector = msix_vec;
+
+	/* create the vring */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,12,0)
+	vq = vring_create_virtqueue(index, num, VIRTIO_PCI_VRING_ALIGN,
+				    &vp_dev->vdev, true, false,
+				    vp_notify, callback, name);
+#else
+	vq = vring_create_virtqueue(index, num, VIRTIO_PCI_VRING_ALIGN,
+				    &vp_dev->vdev, true, false, ctx,
+				    vp_notify, callback, name);
+#endif
+	if (!vq)
+		return ERR_PTR(-ENOMEM);
+
+	q_pfn = virtqueue_get_desc_addr(vq) >> VIRTIO_PCI_QUEUE_ADDR_SHIFT;
+	if (q_pfn >> 32) {
+		dev_err(&vp_dev->pci_dev->dev,
+			"legacy virtio rings must be below %lluGB of RAM\n",
+			0x1ULL << (32 + PAGE_SHIFT - 30));
+		err = -E2BIG;
+		goto out_del_vq;
+	}
+
+	/* activate the queue */
+	iowrite32(q_pfn, vp_dev->ioaddr + VIRTIO_PCI_QUEUE_PFN);
+
+	vq->priv = (void __force *)vp_dev->ioaddr + VIRTIO_PCI_QUEUE_NOTIFY;
+
+	if (msix_vec != VIRTIO_MSI_NO_VECTOR) {
+		iowrite16(msix_vec, vp_dev->ioaddr + VIRTIO_MSI_QUEUE_VECTOR);
+		msix_vec = ioread16(vp_dev->ioaddr + VIRTIO_MSI_QUEUE_VECTOR);
+		if (msix_vec == VIRTIO_MSI_NO_VECTOR) {
+			err = -EBUSY;
+			goto out_deactivate;
+		}
+	}
+
+	return vq;
+
+out_deactivate:
+	iowrite32(0, vp_dev->ioaddr + VIRTIO_PCI_QUEUE_PFN);
+out_del_vq:
+	vring_del_virtqueue(vq);
+	return ERR_PTR(err);
 }
 
 static void del_vq(struct virtio_pci_vq_info *info)
 {
-	// XXX: we don't use virt queues
+	struct virtqueue *vq = info->vq;
+	struct virtio_pci_device *vp_dev = to_vp_device(vq->vdev);
+
+	iowrite16(vq->index, vp_dev->ioaddr + VIRTIO_PCI_QUEUE_SEL);
+
+	if (vp_dev->msix_enabled) {
+		iowrite16(VIRTIO_MSI_NO_VECTOR,
+			  vp_dev->ioaddr + VIRTIO_MSI_QUEUE_VECTOR);
+		/* Flush the write out to device */
+		ioread8(vp_dev->ioaddr + VIRTIO_PCI_ISR);
+	}
+
+	/* Select and deactivate the queue */
+	iowrite32(0, vp_dev->ioaddr + VIRTIO_PCI_QUEUE_PFN);
+
+	vring_del_virtqueue(vq);
 }
 
 static const struct virtio_config_ops virtio_pci_config_ops = {
@@ -290,3 +450,7 @@ void virtio_pci_obsd_remove(struct virtio_pci_device *vp_dev)
 	pci_iounmap(pci_dev, vp_dev->ioaddr);
 	pci_release_region(pci_dev, 0);
 }
+
+#ifdef CONFIG_VIRTIO_VMMCI_KUNIT_TEST
+#include "virtio_pci_openbsd_test.c"
+#endif
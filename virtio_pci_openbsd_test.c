@@ -0,0 +1,234 @@
+/*
+ * KUnit tests for the OpenBSD virtio PCI transport.
+ *
+ * Included at the end of virtio_pci_openbsd.c with
+ * CONFIG_VIRTIO_VMMCI_KUNIT_TEST. The time registers are replaced by a
+ * script of what each read returns, so vp_get_time() can be made to see
+ * the seconds roll over between its reads. The other accessors run
+ * against plain memory.
+ */
+#include <kunit/test.h>
+
+#define VP_TEST_READS	8
+
+struct vp_test_clock {
+	u32 sec[VP_TEST_READS];		/* successive seconds reads */
+	u32 usec[VP_TEST_READS];	/* and microseconds reads */
+	u32 sec_hi;
+	unsigned int sec_pos;
+	unsigned int usec_pos;
+	unsigned int hi_reads;
+};
+
+/* Each read takes the next value, and once the script runs out (a 0
+ * follows) the last one again.
+ */
+static u32 vp_test_next(const u32 *vals, unsigned int *pos)
+{
+	u32 v = vals[*pos];
+
+	if (*pos < VP_TEST_READS - 1 && vals[*pos + 1])
+		(*pos)++;
+	return v;
+}
+
+static u32 vp_test_time_read(void __iomem *config_addr, unsigned int offset)
+{
+	struct vp_test_clock *clk = kunit_get_current_test()->priv;
+
+	switch (offset) {
+	case VMMCI_CONFIG_TIME_SEC:
+		return vp_test_next(clk->sec, &clk->sec_pos);
+	case VMMCI_CONFIG_TIME_SEC + sizeof(u32):
+		clk->hi_reads++;
+		return clk->sec_hi;
+	case VMMCI_CONFIG_TIME_USEC:
+		return vp_test_next(clk->usec, &clk->usec_pos);
+	}
+	return 0;
+}
+
+static struct virtio_pci_device *vp_test_device(struct kunit *test)
+{
+	struct virtio_pci_device *vp_dev;
+
+	vp_dev = kunit_kzalloc(test, sizeof(*vp_dev), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, vp_dev);
+	spin_lock_init(&vp_dev->time_lock);
+	return vp_dev;
+}
+
+static int vp_test_init(struct kunit *test)
+{
+	struct vp_test_clock *clk;
+
+	clk = kunit_kzalloc(test, sizeof(*clk), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, clk);
+	test->priv = clk;
+
+	kunit_activate_static_stub(test, vp_time_read, vp_test_time_read);
+	return 0;
+}
+
+/* Seconds that match on both sides of the microseconds are taken as
+ * they are, and the upper half is only fetched the first time.
+ */
+static void vp_test_time_plain(struct kunit *test)
+{
+	struct virtio_pci_device *vp_dev = vp_test_device(test);
+	struct vp_test_clock *clk = test->priv;
+	struct vmmci_time_snapshot snap;
+
+	clk->sec[0] = 100;
+	clk->usec[0] = 500000;
+	clk->sec_hi = 1;
+
+	vp_get_time(vp_dev, NULL, &snap);
+	KUNIT_EXPECT_EQ(test, snap.sec, (1LL << 32) + 100);
+	KUNIT_EXPECT_EQ(test, snap.usec, 500000);
+	KUNIT_EXPECT_EQ(test, snap.retries, 0);
+	KUNIT_EXPECT_EQ(test, snap.reads, 4);
+
+	vp_get_time(vp_dev, NULL, &snap);
+	KUNIT_EXPECT_EQ(test, snap.sec, (1LL << 32) + 100);
+	KUNIT_EXPECT_EQ(test, snap.reads, 3);
+	KUNIT_EXPECT_EQ(test, clk->hi_reads, 1);
+}
+
+/* The seconds rolled over after the microseconds were read, as if we'd
+ * been preempted there, so 101.999900 would have been almost a second
+ * late. Large microseconds don't excuse the pair from the check.
+ */
+static void vp_test_time_late_rollover(struct kunit *test)
+{
+	struct virtio_pci_device *vp_dev = vp_test_device(test);
+	struct vp_test_clock *clk = test->priv;
+	struct vmmci_time_snapshot snap;
+
+	clk->sec[0] = 100;
+	clk->sec[1] = 101;
+	clk->usec[0] = 999900;
+	clk->usec[1] = 100;
+
+	vp_get_time(vp_dev, NULL, &snap);
+	KUNIT_EXPECT_EQ(test, snap.sec, 101);
+	KUNIT_EXPECT_EQ(test, snap.usec, 100);
+	KUNIT_EXPECT_EQ(test, snap.retries, 1);
+	KUNIT_EXPECT_EQ(test, snap.reads, 6);
+}
+
+/* The seconds rolled over after the first read, so 100.000200 would have
+ * been almost a second early. The retry gets the pair from after it.
+ */
+static void vp_test_time_torn(struct kunit *test)
+{
+	struct virtio_pci_device *vp_dev = vp_test_device(test);
+	struct vp_test_clock *clk = test->priv;
+	struct vmmci_time_snapshot snap;
+
+	clk->sec[0] = 100;
+	clk->sec[1] = 101;
+	clk->usec[0] = 200;
+	clk->usec[1] = 300;
+
+	vp_get_time(vp_dev, NULL, &snap);
+	KUNIT_EXPECT_EQ(test, snap.sec, 101);
+	KUNIT_EXPECT_EQ(test, snap.usec, 300);
+	KUNIT_EXPECT_EQ(test, snap.retries, 1);
+	KUNIT_EXPECT_EQ(test, snap.reads, 6);
+}
+
+/* A clock that keeps moving under us is given up on after a few tries,
+ * small microseconds going with the last seconds read.
+ */
+static void vp_test_time_max_retries(struct kunit *test)
+{
+	struct virtio_pci_device *vp_dev = vp_test_device(test);
+	struct vp_test_clock *clk = test->priv;
+	struct vmmci_time_snapshot snap;
+	int i;
+
+	for (i = 0; i < VP_TEST_READS; i++) {
+		clk->sec[i] = 100 + i;
+		clk->usec[i] = 10;
+	}
+
+	vp_get_time(vp_dev, NULL, &snap);
+	KUNIT_EXPECT_EQ(test, snap.retries, VP_TIME_MAX_RETRIES);
+	KUNIT_EXPECT_EQ(test, snap.sec, 100 + VP_TIME_MAX_RETRIES + 1);
+	KUNIT_EXPECT_EQ(test, snap.reads, 2 * (VP_TIME_MAX_RETRIES + 1) + 2);
+}
+
+/* The lower half of the seconds wrapping sends us back for the upper */
+static void vp_test_time_wrap(struct kunit *test)
+{
+	struct virtio_pci_device *vp_dev = vp_test_device(test);
+	struct vp_test_clock *clk = test->priv;
+	struct vmmci_time_snapshot snap;
+
+	vp_dev->time_sec_hi_valid = true;
+	vp_dev->time_sec_lo = 0xffffffff;
+	clk->sec[0] = 5;
+	clk->usec[0] = 500000;
+	clk->sec_hi = 1;
+
+	vp_get_time(vp_dev, NULL, &snap);
+	KUNIT_EXPECT_EQ(test, snap.sec, (1LL << 32) + 5);
+	KUNIT_EXPECT_EQ(test, clk->hi_reads, 1);
+}
+
+/* vp_get and vp_set go a register at a time, the 8-byte case as two
+ * 32-bit halves. Plain memory stands in for the device, which ioread and
+ * iowrite take as mmio since it's nowhere near the port range.
+ */
+static void vp_test_accessors(struct kunit *test)
+{
+	struct virtio_pci_device *vp_dev = vp_test_device(test);
+	u8 b = 0x5a, b2;
+	__le16 w = cpu_to_le16(0x1234), w2;
+	__le32 l = cpu_to_le32(0x89abcdef), l2;
+	__le64 q = cpu_to_le64(0x0123456789abcdefULL), q2;
+	u8 *regs, *config;
+
+	regs = kunit_kzalloc(test, VIRTIO_PCI_CONFIG_OFF(false) + 16,
+	    GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, regs);
+	vp_dev->ioaddr = (void __iomem *) regs;
+	config = regs + VIRTIO_PCI_CONFIG_OFF(false);
+
+	vp_set(&vp_dev->vdev, 0, &b, sizeof(b));
+	vp_set(&vp_dev->vdev, 2, &w, sizeof(w));
+	vp_set(&vp_dev->vdev, 4, &l, sizeof(l));
+	vp_set(&vp_dev->vdev, 8, &q, sizeof(q));
+	KUNIT_EXPECT_EQ(test, config[0], 0x5a);
+	KUNIT_EXPECT_EQ(test, memcmp(config + 2, &w, sizeof(w)), 0);
+	KUNIT_EXPECT_EQ(test, memcmp(config + 4, &l, sizeof(l)), 0);
+	KUNIT_EXPECT_EQ(test, memcmp(config + 8, &q, sizeof(q)), 0);
+
+	vp_get(&vp_dev->vdev, 0, &b2, sizeof(b2));
+	vp_get(&vp_dev->vdev, 2, &w2, sizeof(w2));
+	vp_get(&vp_dev->vdev, 4, &l2, sizeof(l2));
+	vp_get(&vp_dev->vdev, 8, &q2, sizeof(q2));
+	KUNIT_EXPECT_EQ(test, b2, 0x5a);
+	KUNIT_EXPECT_EQ(test, le16_to_cpu(w2), 0x1234);
+	KUNIT_EXPECT_EQ(test, le32_to_cpu(l2), 0x89abcdef);
+	KUNIT_EXPECT_EQ(test, le64_to_cpu(q2), 0x0123456789abcdefULL);
+}
+
+static struct kunit_case vp_test_cases[] = {
+	KUNIT_CASE(vp_test_time_plain),
+	KUNIT_CASE(vp_test_time_late_rollover),
+	KUNIT_CASE(vp_test_time_torn),
+	KUNIT_CASE(vp_test_time_max_retries),
+	KUNIT_CASE(vp_test_time_wrap),
+	KUNIT_CASE(vp_test_accessors),
+	{ },
+};
+
+static struct kunit_suite vp_test_suite = {
+	.name		= "virtio_pci_obsd",
+	.init		= vp_test_init,
+	.test_cases	= vp_test_cases,
+};
+
+kunit_test_suite(vp_test_suite);
@@ -19,213 +19,2751 @@
  *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <linux/clocksource.h>
+#include <linux/debugfs.h>
+#include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/kallsyms.h>
+#include <linux/kfifo.h>
+#include <linux/kmod.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <net/genetlink.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
+#include <linux/percpu.h>
+#include <linux/ptp_clock_kernel.h>
 #include <linux/reboot.h>
 #include <linux/rtc.h>
+#include <linux/scatterlist.h>
+#include <linux/seqlock.h>
+#include <linux/seq_file.h>
 #include <linux/sysctl.h>
 #include <linux/time64.h>
 #include <linux/timekeeping.h>
+#include <linux/timex.h>
+#include <linux/uaccess.h>
 #include <linux/virtio.h>
 #include <linux/virtio_config.h>
+#ifdef CONFIG_X86
+#include <asm/tsc.h>
+#endif
+
+#include "virtio_vmmci.h"
+#include "virtio_vmmci_uapi.h"
+
+#define CREATE_TRACE_POINTS
+#include "virtio_vmmci_trace.h"
+
+/* You can either change the global debug level here by changing the
+ * initialization value for "debug" or configure it at runtime via
+ * the kernel module parameter. See README.md for details.
+ */
+static int debug = 0;
+DEFINE_STATIC_KEY_FALSE(vmmci_debug_key);
+
+static int set_debug(const char *val, const struct kernel_param *kp)
+{
+	int n = 0, rc;
+	rc = kstrtoint(val, 10, &n);
+	if (rc || n < 0)
+		return -EINVAL;
+
+	rc = param_set_int(val, kp);
+	if (rc)
+		return rc;
+
+	if (n)
+		static_branch_enable(&vmmci_debug_key);
+	else
+		static_branch_disable(&vmmci_debug_key);
+	return 0;
+}
+
+static int get_debug(char *buffer, const struct kernel_param *kp)
+{
+	int bytes;
+	bytes = snprintf(buffer, 1024, "%d\n", debug);
+	return bytes + 1; // account for NULL
+}
+
+static const struct kernel_param_ops debug_param_ops = {
+	.set	= set_debug,
+	.get	= get_debug,
+};
+
+module_param_cb(debug, &debug_param_ops, &debug, 0664);
+
+/* Where SYNCRTC takes the time from. The vmmci host time registers are
+ * microsecond precise, whereas the emulated mc146818 only gives us whole
+ * seconds, so the rtc is only used when the host doesn't offer TIMESYNC
+ * or when asked to via the "sync_source" module parameter.
+ */
+enum vmmci_sync_source {
+	VMMCI_SYNC_HOST = 0,
+	VMMCI_SYNC_RTC,
+};
+
+static const char * const sync_source_names[] = {
+	[VMMCI_SYNC_HOST]	= "host",
+	[VMMCI_SYNC_RTC]	= "rtc",
+};
+
+static int sync_source = VMMCI_SYNC_HOST;
+
+/* Looks up a (possibly newline terminated) name, returning its index */
+static int match_name(const char * const names[], size_t n, const char *val)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (sysfs_streq(val, names[i]))
+			return i;
+
+	return -EINVAL;
+}
+
+static int set_sync_source(const char *val, const struct kernel_param *kp)
+{
+	int n;
+
+	n = match_name(sync_source_names, ARRAY_SIZE(sync_source_names), val);
+	if (n < 0)
+		return n;
+
+	*(int *) kp->arg = n;
+	return 0;
+}
+
+static int get_sync_source(char *buffer, const struct kernel_param *kp)
+{
+	return sprintf(buffer, "%s\n", sync_source_names[*(int *) kp->arg]);
+}
+
+static const struct kernel_param_ops sync_source_param_ops = {
+	.set	= set_sync_source,
+	.get	= get_sync_source,
+};
+
+module_param_cb(sync_source, &sync_source_param_ops, &sync_source, 0664);
+MODULE_PARM_DESC(sync_source, "Clock source for SYNCRTC: host (default) or rtc");
+
+/* Slewing and frequency correction need the kernel's do_adjtimex, which
+ * isn't exported to modules. Before 5.7 it can be looked up through
+ * kallsyms; since then there's no way to reach it, so the settings that
+ * need it are refused with -EOPNOTSUPP rather than quietly stepping.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,1,0)
+typedef struct timex vmmci_timex_t;
+#else
+typedef struct __kernel_timex vmmci_timex_t;
+#endif
+
+static int (*vmmci_adjtimex)(vmmci_timex_t *);
+
+static bool resolve_adjtimex(void)
+{
+#if defined(CONFIG_KALLSYMS) && LINUX_VERSION_CODE < KERNEL_VERSION(5,7,0)
+	if (vmmci_adjtimex == NULL)
+		vmmci_adjtimex = (void *) kallsyms_lookup_name("do_adjtimex");
+#endif
+	return vmmci_adjtimex != NULL;
+}
+
+/* How a measured offset gets corrected. Stepping with do_settimeofday64
+ * fires clock_was_set and can move time backwards, so "slew" instead
+ * asks the kernel's NTP code to amortize offsets up to the step threshold
+ * (the same as adjtime(3) does) and only steps for anything larger.
+ *
+ * These are the defaults for new devices. Each device can be tuned via
+ * its correct_mode and step_threshold_us sysfs attributes.
+ */
+enum vmmci_correct_mode {
+	VMMCI_CORRECT_STEP = 0,
+	VMMCI_CORRECT_SLEW,
+};
+
+static const char * const correct_mode_names[] = {
+	[VMMCI_CORRECT_STEP]	= "step",
+	[VMMCI_CORRECT_SLEW]	= "slew",
+};
+
+static int correct_mode = VMMCI_CORRECT_STEP;
+
+static int set_correct_mode(const char *val, const struct kernel_param *kp)
+{
+	int n;
+
+	n = match_name(correct_mode_names, ARRAY_SIZE(correct_mode_names), val);
+	if (n < 0)
+		return n;
+	if (n == VMMCI_CORRECT_SLEW && !resolve_adjtimex())
+		return -EOPNOTSUPP;
+
+	*(int *) kp->arg = n;
+	return 0;
+}
+
+static int get_correct_mode(char *buffer, const struct kernel_param *kp)
+{
+	return sprintf(buffer, "%s\n", correct_mode_names[*(int *) kp->arg]);
+}
+
+static const struct kernel_param_ops correct_mode_param_ops = {
+	.set	= set_correct_mode,
+	.get	= get_correct_mode,
+};
+
+module_param_cb(correct_mode, &correct_mode_param_ops, &correct_mode, 0664);
+MODULE_PARM_DESC(correct_mode, "Default clock correction: step (default) or slew");
+
+/* ntpd(8)'s default step threshold */
+static unsigned int step_threshold_us = 128000;
+module_param(step_threshold_us, uint, 0664);
+MODULE_PARM_DESC(step_threshold_us, "Default offset (us) above which slew mode steps anyway");
+
+/* A slew is considered done once the remaining offset is below this */
+#define VMMCI_SLEW_DONE_NS	(100 * NSEC_PER_USEC)
+
+/* The frequency error of our clock is fitted over a sliding window of the
+ * last freq_window drift samples. With freq_correct it's also handed to
+ * the kernel's NTP code, so the guest clock keeps pace with the host
+ * between samples. (There's only one system clock, so unlike the
+ * correction mode this isn't a per-device setting.)
+ */
+#define VMMCI_FREQ_WINDOW_MAX	32
+#define VMMCI_FREQ_MIN_SAMPLES	3
+/* The kernel won't go beyond 500 ppm either */
+#define VMMCI_FREQ_MAX_PPB	500000
+/* Points further back than this from the newest are left out of the fit,
+ * whatever freq_window and monitor_max_ms say, so its sums can't overflow
+ * (see update_freq). Four hours is 32 of the default longest interval. */
+#define VMMCI_FREQ_SPAN_MAX_MS	(4 * 3600 * MSEC_PER_SEC)
+
+static unsigned int freq_window = 8;
+static bool freq_correct = false;
+
+static int set_freq_window(const char *val, const struct kernel_param *kp)
+{
+	unsigned int n;
+	int rc;
+
+	rc = kstrtouint(val, 10, &n);
+	if (rc || n < VMMCI_FREQ_MIN_SAMPLES || n > VMMCI_FREQ_WINDOW_MAX)
+		return -EINVAL;
+
+	return param_set_uint(val, kp);
+}
+
+static const struct kernel_param_ops freq_window_param_ops = {
+	.set	= set_freq_window,
+	.get	= param_get_uint,
+};
+
+module_param_cb(freq_window, &freq_window_param_ops, &freq_window, 0664);
+MODULE_PARM_DESC(freq_window, "Drift samples to fit the frequency error over (3-32)");
+
+/* For the bool settings that, like slew mode, need do_adjtimex */
+static int set_adjtimex_bool(const char *val, const struct kernel_param *kp)
+{
+	struct kernel_param dummy = *kp;
+	bool on;
+	int rc;
+
+	dummy.arg = &on;
+	rc = param_set_bool(val, &dummy);
+	if (rc)
+		return rc;
+	if (on && !resolve_adjtimex())
+		return -EOPNOTSUPP;
+
+	*(bool *) kp->arg = on;
+	return 0;
+}
+
+static const struct kernel_param_ops adjtimex_bool_param_ops = {
+	.set	= set_adjtimex_bool,
+	.get	= param_get_bool,
+};
+
+module_param_cb(freq_correct, &adjtimex_bool_param_ops, &freq_correct, 0664);
+MODULE_PARM_DESC(freq_correct, "Feed the estimated frequency error to the kernel");
+
+/* Each measurement takes a burst of samples and keeps the one with the
+ * shortest round-trip, like NTP's clock filter. The longer a host reading
+ * takes (VM exits, the host being busy) the less we know about when the
+ * host actually read its clock.
+ */
+#define VMMCI_BURST_MAX		16
+
+static unsigned int burst = 4;
+
+static int set_burst(const char *val, const struct kernel_param *kp)
+{
+	unsigned int n;
+	int rc;
+
+	rc = kstrtouint(val, 10, &n);
+	if (rc || n < 1 || n > VMMCI_BURST_MAX)
+		return -EINVAL;
+
+	return param_set_uint(val, kp);
+}
+
+static const struct kernel_param_ops burst_param_ops = {
+	.set	= set_burst,
+	.get	= param_get_uint,
+};
+
+module_param_cb(burst, &burst_param_ops, &burst, 0664);
+MODULE_PARM_DESC(burst, "Samples per drift measurement, keeping the fastest (1-16)");
+
+/* vmd(8) can fire SYNCRTC several times in a row, on resume say, and each
+ * sync steps the clock and makes everyone in the guest notice. So
+ * requests that come in while a sync is pending are folded into it, and
+ * syncs start at least sync_min_interval_ms apart.
+ */
+static unsigned int sync_min_interval_ms = 1000;
+module_param(sync_min_interval_ms, uint, 0664);
+MODULE_PARM_DESC(sync_min_interval_ms, "Shortest time between two clock syncs (ms)");
+
+/* The host clock is also offered as a PTP hardware clock (/dev/ptpN) so
+ * time daemons can use it directly, e.g. chrony's "refclock PHC". They do
+ * their own filtering and pacing, so the drift monitor can be turned off.
+ */
+static bool ptp = true;
+module_param(ptp, bool, 0444);
+MODULE_PARM_DESC(ptp, "Expose the host clock as a PTP hardware clock");
+
+/* Sync to the host as soon as the device probes, so a guest loading us
+ * from its initramfs, or with the driver built in, starts out with host
+ * time instead of the rtc's whole seconds.
+ */
+static bool initial_sync = true;
+module_param(initial_sync, bool, 0444);
+MODULE_PARM_DESC(initial_sync, "Sync the clock to the host when the device probes");
+
+/* With VMMCI_F_REPORT, write every drift sample and clock sync back to the
+ * host's report registers so it can watch drift without asking us. */
+static bool report_drift = true;
+module_param(report_drift, bool, 0644);
+MODULE_PARM_DESC(report_drift, "Report drift to the host if it supports it");
+
+static bool monitor = true;
+module_param(monitor, bool, 0444);
+MODULE_PARM_DESC(monitor, "Periodically measure the drift from the host clock");
+
+/* Every drift measurement costs a handful of VM exits, which adds up with
+ * hundreds of idle guests on a host. So the monitor backs off
+ * exponentially from monitor_min_ms up to monitor_max_ms while the drift
+ * moves less than monitor_stable_us between samples, and goes back to
+ * monitor_min_ms after a jump or a SYNCRTC.
+ */
+static unsigned int monitor_min_ms = 20000;
+module_param(monitor_min_ms, uint, 0664);
+MODULE_PARM_DESC(monitor_min_ms, "Shortest interval between drift measurements (ms)");
+
+static unsigned int monitor_max_ms = 320000;
+module_param(monitor_max_ms, uint, 0664);
+MODULE_PARM_DESC(monitor_max_ms, "Longest interval between drift measurements (ms)");
+
+static unsigned int monitor_stable_us = 1000;
+module_param(monitor_stable_us, uint, 0664);
+MODULE_PARM_DESC(monitor_stable_us, "Change in drift (us) below which the monitor backs off");
+
+/* When the host suspends, the guest is frozen with it and comes back with
+ * its clock behind by however long the host slept. If the host clock moved
+ * this much further than ours between two drift samples (more than any
+ * frequency error could explain), resync right away instead of waiting
+ * for the host's SYNCRTC.
+ */
+static unsigned int suspend_threshold_ms = 1000;
+module_param(suspend_threshold_ms, uint, 0664);
+MODULE_PARM_DESC(suspend_threshold_ms, "Unexplained host clock jump (ms) treated as a host suspend");
+
+/* With auto_correct, the monitor doesn't wait for a SYNCRTC to fix the
+ * drift it measures. Once the offset leaves the auto_slew_us band it's
+ * slewed away, or stepped if it's beyond auto_step_us. Past auto_alert_ms
+ * the driver only warns: a clock that far off means something is badly
+ * wrong (maybe with the host clock), and blindly stepping would hide it.
+ * The offset has to come back under half the band before it counts as
+ * settled, and corrections are at least auto_hold_ms apart, so a noisy
+ * sample or two can't make it flap. Slewing needs do_adjtimex, so
+ * enabling it fails with -EOPNOTSUPP where that can't be resolved.
+ */
+enum vmmci_auto_state {
+	VMMCI_AUTO_SETTLED = 0,
+	VMMCI_AUTO_CORRECTING,
+	VMMCI_AUTO_ALERT,
+};
+
+static bool auto_correct = false;
+module_param_cb(auto_correct, &adjtimex_bool_param_ops, &auto_correct, 0664);
+MODULE_PARM_DESC(auto_correct, "Correct measured drift without waiting for the host");
+
+static unsigned int auto_slew_us = 1000;
+module_param(auto_slew_us, uint, 0664);
+MODULE_PARM_DESC(auto_slew_us, "Drift (us) auto_correct lets be");
+
+static unsigned int auto_step_us = 128000;
+module_param(auto_step_us, uint, 0664);
+MODULE_PARM_DESC(auto_step_us, "Drift (us) above which auto_correct steps instead of slewing");
+
+static unsigned int auto_alert_ms = 60000;
+module_param(auto_alert_ms, uint, 0664);
+MODULE_PARM_DESC(auto_alert_ms, "Drift (ms) above which auto_correct only warns (0 for no limit)");
+
+static unsigned int auto_hold_ms = 60000;
+module_param(auto_hold_ms, uint, 0664);
+MODULE_PARM_DESC(auto_hold_ms, "Shortest time between two automatic corrections (ms)");
+
+/* The host clock can also be registered as a (slow, low rated) clocksource.
+ * It's the best candidate for the kernel's clocksource watchdog, giving it
+ * an independent reference to validate the TSC against instead of marking
+ * it unstable and falling back to something slower. Opt-in, as the host
+ * stepping its own clock looks like TSC skew to the watchdog.
+ *
+ * It isn't flagged continuous, which only keeps it from being picked for
+ * timekeeping while the kernel runs its tick in oneshot mode (tickless or
+ * high resolution timers). With a periodic tick (nohz=off highres=off, or
+ * a kernel built without either) it's chosen like any other once the TSC
+ * is marked unstable, if nothing better rated is left, and every clock
+ * read then costs a trip to the host.
+ */
+#define VMMCI_CLOCKSOURCE_RATING	150
+
+static bool watchdog = false;
+module_param(watchdog, bool, 0444);
+MODULE_PARM_DESC(watchdog, "Register the host clock as a clocksource watchdog for the TSC (with a periodic tick it may also end up as the clocksource)");
+
+/* All of the driver's work runs on one unbound workqueue, visible in
+ * sysfs as /sys/devices/virtual/workqueue/vmmci, so its cpumask can be
+ * kept to housekeeping cpus on guests using nohz_full or isolcpus. With
+ * wq_highpri its workers run at high priority, so a SYNCRTC or a
+ * shutdown isn't stuck behind other work.
+ */
+static bool wq_highpri = false;
+module_param(wq_highpri, bool, 0444);
+MODULE_PARM_DESC(wq_highpri, "Run the driver's work on high priority workers");
+
+static struct workqueue_struct *vmmci_wq;
+
+/* Host shutdowns and reboots go through userspace, which can take its
+ * time or hang outright while the host waits on us. With
+ * shutdown_timeout_s set, writeback starts as soon as the command comes
+ * in, and if userspace hasn't gotten the kernel to power off or reboot by
+ * the deadline, the driver syncs again and forces it.
+ */
+static unsigned int shutdown_timeout_s = 0;
+module_param(shutdown_timeout_s, uint, 0664);
+MODULE_PARM_DESC(shutdown_timeout_s, "Force a host shutdown or reboot after this many seconds (0 waits forever)");
+
+/* A host reboot normally ends in the firmware and bootloader all over
+ * again. With kexec_reboot, if a kexec image is loaded, the driver runs
+ * kexec_reboot_cmd instead of the usual reboot, which is expected to shut
+ * userspace down in order and then kexec into the image.
+ */
+static bool kexec_reboot = false;
+module_param(kexec_reboot, bool, 0644);
+MODULE_PARM_DESC(kexec_reboot, "Reboot into the loaded kexec image on host reboots");
+
+static char *kexec_reboot_cmd = "/bin/systemctl kexec";
+module_param(kexec_reboot_cmd, charp, 0444);
+MODULE_PARM_DESC(kexec_reboot_cmd, "Command that shuts down and kexecs, for kexec_reboot");
+
+
+/* Define our basic commands and structs for our device including the
+ * virtio feature tables.
+ */
+enum vmmci_cmd {
+	VMMCI_NONE = 0,
+	VMMCI_SHUTDOWN,
+	VMMCI_REBOOT,
+	VMMCI_SYNCRTC,
+};
+
+/* The latest drift measurement as a whole, published under a seqlock so
+ * readers get every field from the same sample without ever holding up
+ * the monitor. Reading drift_sec and drift_nsec one at a time can't
+ * promise that.
+ */
+struct vmmci_drift_state {
+	s64 offset;	/* host - guest (ns) */
+	s64 delay;	/* round-trip of the host reading (ns) */
+	s64 time;	/* host realtime of the sample (ns) */
+	u64 samples;
+};
+
+static void drift_state_read(seqlock_t *lock, const struct vmmci_drift_state *src,
+			     struct vmmci_drift_state *dst)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(lock);
+		*dst = *src;
+	} while (read_seqretry(lock, seq));
+}
+
+/* "offset_ns delay_ns time_ns samples", no newline */
+static int drift_state_format(const struct vmmci_drift_state *st, char *buf,
+			      size_t len)
+{
+	return scnprintf(buf, len, "%lld %lld %lld %llu", st->offset,
+	    st->delay, st->time, st->samples);
+}
+
+/* One measurement of the host clock against ours. The guest timestamps
+ * are taken halfway between the readings bracketing the host's. */
+struct vmmci_sample {
+	s64 host;	/* host realtime (ns) */
+	s64 guest;	/* guest realtime (ns) */
+	s64 raw;	/* guest raw monotonic (ns), immune to our corrections */
+	s64 offset;	/* host - guest (ns) */
+	s64 delay;	/* round-trip of the host reading (ns) */
+	u64 tsc;	/* guest TSC, if there is one */
+};
+
+/* A point in the frequency fit: raw time (ms) against host - raw (ns) */
+struct vmmci_freq_point {
+	s64 x;
+	s64 y;
+};
+
+/* Commands ACKed from the interrupt, waiting to be dispatched */
+#define VMMCI_CMD_QUEUE_LEN	8
+
+/* Buffers kept on the event queue, one per command in flight */
+#define VMMCI_EVENTQ_BUFS	VMMCI_CMD_QUEUE_LEN
+
+struct vmmci_cmd_entry {
+	s32 cmd;
+	bool acked;
+};
+
+/* Recent samples for debugfs. Filled by the monitor and read without
+ * locks, see vmmci_drift_record() and drift_history_read().
+ */
+#define VMMCI_DRIFT_RING_LEN	256
+
+/* Latency histograms, in log2 buckets of nanoseconds: bucket n counts
+ * [2^n, 2^(n+1)), except that bucket 0 also takes 0 and the last one
+ * takes everything above. They're updated without locks, so a read or
+ * reset racing an update may be off by a sample.
+ */
+#define VMMCI_HIST_BUCKETS	32
+
+struct vmmci_hist {
+	atomic64_t count;
+	atomic64_t sum;
+	atomic64_t max;
+	atomic64_t buckets[VMMCI_HIST_BUCKETS];
+};
+
+enum vmmci_hist_id {
+	VMMCI_HIST_GET_1,
+	VMMCI_HIST_GET_2,
+	VMMCI_HIST_GET_4,
+	VMMCI_HIST_GET_8,
+	VMMCI_HIST_GET_TIME,	/* a whole struct vmmci_time_snapshot */
+	VMMCI_HIST_SET_1,
+	VMMCI_HIST_SET_2,
+	VMMCI_HIST_SET_4,
+	VMMCI_HIST_SET_8,
+	VMMCI_HIST_IRQ,		/* vmmci_changed, start to finish */
+	VMMCI_HIST_SYNC,	/* sync_system_time */
+	VMMCI_HIST_MONITOR_LATE,	/* monitor_work past its due time */
+	VMMCI_HIST_MAX,
+};
+
+static const char * const vmmci_hist_names[] = {
+	[VMMCI_HIST_GET_1]		= "get_1",
+	[VMMCI_HIST_GET_2]		= "get_2",
+	[VMMCI_HIST_GET_4]		= "get_4",
+	[VMMCI_HIST_GET_8]		= "get_8",
+	[VMMCI_HIST_GET_TIME]		= "get_time",
+	[VMMCI_HIST_SET_1]		= "set_1",
+	[VMMCI_HIST_SET_2]		= "set_2",
+	[VMMCI_HIST_SET_4]		= "set_4",
+	[VMMCI_HIST_SET_8]		= "set_8",
+	[VMMCI_HIST_IRQ]		= "irq",
+	[VMMCI_HIST_SYNC]		= "sync",
+	[VMMCI_HIST_MONITOR_LATE]	= "monitor_late",
+};
+
+/* Event counts, kept per cpu so the interrupt path never writes a shared
+ * cache line, and summed when read. See the stats attribute.
+ */
+enum vmmci_counter {
+	VMMCI_CNT_CONFIG_IRQS,		/* vmmci_changed calls */
+	VMMCI_CNT_CONFIG_IRQS_CMD,	/* ...that found a command */
+	VMMCI_CNT_EVENTQ_IRQS,		/* vmmci_event_done calls */
+	VMMCI_CNT_CMD_SHUTDOWN,
+	VMMCI_CNT_CMD_REBOOT,
+	VMMCI_CNT_CMD_SYNCRTC,
+	VMMCI_CNT_CMD_UNKNOWN,
+	VMMCI_CNT_CMD_DROPPED,		/* command queue full */
+	VMMCI_CNT_ACKS,			/* written to the command register */
+	VMMCI_CNT_SYNC_OK,
+	VMMCI_CNT_SYNC_FAILED,
+	VMMCI_CNT_MONITOR_RUNS,
+	VMMCI_CNT_TIME_RETRIES,		/* torn host time reads retried */
+	VMMCI_CNT_RTC_OPEN_FAILED,
+	VMMCI_CNT_MAX,
+};
+
+static const char * const vmmci_counter_names[] = {
+	[VMMCI_CNT_CONFIG_IRQS]		= "config_irqs",
+	[VMMCI_CNT_CONFIG_IRQS_CMD]	= "config_irqs_cmd",
+	[VMMCI_CNT_EVENTQ_IRQS]		= "eventq_irqs",
+	[VMMCI_CNT_CMD_SHUTDOWN]	= "cmd_shutdown",
+	[VMMCI_CNT_CMD_REBOOT]		= "cmd_reboot",
+	[VMMCI_CNT_CMD_SYNCRTC]		= "cmd_syncrtc",
+	[VMMCI_CNT_CMD_UNKNOWN]		= "cmd_unknown",
+	[VMMCI_CNT_CMD_DROPPED]		= "cmd_dropped",
+	[VMMCI_CNT_ACKS]		= "acks",
+	[VMMCI_CNT_SYNC_OK]		= "sync_ok",
+	[VMMCI_CNT_SYNC_FAILED]		= "sync_failed",
+	[VMMCI_CNT_MONITOR_RUNS]	= "monitor_runs",
+	[VMMCI_CNT_TIME_RETRIES]	= "time_retries",
+	[VMMCI_CNT_RTC_OPEN_FAILED]	= "rtc_open_failed",
+};
+
+struct vmmci_counters {
+	unsigned long v[VMMCI_CNT_MAX];
+};
+
+struct virtio_vmmci {
+	struct virtio_device *vdev;
+
+	/* Commands are read and ACKed in the interrupt, everything else
+	 * happens here. */
+	struct work_struct cmd_work;
+	DECLARE_KFIFO(cmd_queue, struct vmmci_cmd_entry, VMMCI_CMD_QUEUE_LEN);
+	spinlock_t cmd_lock;
+
+	/* Host commands by virtqueue, see VMMCI_F_EVENTQ */
+	struct virtqueue *event_vq;
+	struct vmmci_eventq_buf events[VMMCI_EVENTQ_BUFS];
+
+	/* Used for monitoring clock drift. Needs scheduling. The rest is
+	 * under correct_lock, since a sync tightens the monitor. */
+	struct delayed_work monitor_work;
+	unsigned long monitor_interval;	/* jiffies */
+	struct vmmci_sample monitor_prev;
+	bool monitor_has_prev;
+	ktime_t monitor_due;
+
+	/* Latest measurement, see struct vmmci_drift_state */
+	seqlock_t drift_lock;
+	struct vmmci_drift_state drift;
+
+	/* Used for synchronizing clock. Queued on vmmci_wq by host
+	 * commands, the monitor and resume, see vmmci_request_sync().
+	 */
+	struct delayed_work sync_work;
+	unsigned long sync_last;	/* jiffies the last sync started */
+	bool sync_ran;
+
+	/* Set by remove and freeze before they cancel the work. The monitor
+	 * and the sync queue each other, so without it whichever was
+	 * cancelled first could be queued again by the other. */
+	bool stopping;
+	atomic_long_t sync_requests;
+	atomic_long_t sync_coalesced;
+	atomic_long_t sync_runs;
+
+	/* Fallback clock for sync when the host doesn't do TIMESYNC,
+	 * opened on first use. */
+	struct rtc_device *rtc;
+
+	/* Clock correction settings, see correct_mode above */
+	int correct_mode;
+	unsigned int step_threshold_us;
+	bool slewing;
+	/* Held from the sample a correction is based on until it's applied,
+	 * by both the sync and the monitor, so neither applies an offset
+	 * the other has just made stale. Also covers the monitor's
+	 * interval, previous sample and due time. */
+	struct mutex correct_lock;
+
+	/* Monitor-only state of the auto_correct policy */
+	int auto_state;
+	unsigned long auto_last;	/* jiffies of the last correction */
+	bool auto_ran;
+	atomic_long_t auto_slews;
+	atomic_long_t auto_steps;
+	atomic_long_t auto_alerts;
+
+	/* The host clock as a PTP hardware clock */
+	struct ptp_clock_info ptp_info;
+	struct ptp_clock *ptp_clock;
+
+	/* The host clock as a clocksource watchdog */
+	struct clocksource clocksource;
+	bool clocksource_registered;
+
+	/* Previous sample, for measuring TSC skew */
+	s64 tsc_prev_host;
+	u64 tsc_prev;
+
+	/* Sliding window for the frequency estimate (a ring) */
+	struct vmmci_freq_point freq_points[VMMCI_FREQ_WINDOW_MAX];
+	unsigned int freq_head;
+	unsigned int freq_count;
+
+	/* Stats, see enum vmmci_stat */
+	s64 ack_latency;		/* config interrupt to ACK, last (ns) */
+	s64 ack_latency_max;		/* and worst */
+	int freq_ppb;
+	int tsc_skew_ppb;
+
+	/* On vmmci_devices */
+	struct list_head node;
+
+	/* Under /sys/kernel/debug/vmmci/ */
+	struct dentry *debugfs;
+	struct vmmci_hist hist[VMMCI_HIST_MAX];
+	struct vmmci_counters __percpu *counters;
+	struct vmmci_drift_record drift_ring[VMMCI_DRIFT_RING_LEN];
+	unsigned long drift_head;	/* records ever written */
+
+	/* What we last reported to the host, see VMMCI_F_REPORT */
+	struct mutex report_lock;
+	u32 report_seq;
+	u32 report_status;
+	s64 report_sync;
+};
+
+/* Values exported per device in sysfs, and for the first device through
+ * the sysctls as well.
+ */
+enum vmmci_stat {
+	/* The last drift measurement and the round-trip of its reading */
+	VMMCI_STAT_DRIFT_SEC,
+	VMMCI_STAT_DRIFT_NSEC,
+	VMMCI_STAT_DELAY,
+	/* Time from a config change interrupt reaching us to the command
+	 * being ACKed, last and worst seen. vmd(8) waits on that ACK. */
+	VMMCI_STAT_ACK_LATENCY,
+	VMMCI_STAT_ACK_LATENCY_MAX,
+	/* Estimated frequency error of our clock versus the host's in parts
+	 * per billion. Positive means the host clock runs faster than ours. */
+	VMMCI_STAT_FREQ_PPB,
+	/* Skew of the TSC versus the host clock in parts per billion,
+	 * measured between drift samples. Positive means the TSC runs slow. */
+	VMMCI_STAT_TSC_SKEW_PPB,
+	/* Host time reads the transport had to retry because the seconds
+	 * rolled over while it was reading the microseconds. */
+	VMMCI_STAT_TIME_RETRIES,
+	/* Syncs asked for, folded into a pending one, and actually run */
+	VMMCI_STAT_SYNC_REQUESTS,
+	VMMCI_STAT_SYNC_COALESCED,
+	VMMCI_STAT_SYNC_RUNS,
+	/* What the auto_correct policy did */
+	VMMCI_STAT_AUTO_SLEWS,
+	VMMCI_STAT_AUTO_STEPS,
+	VMMCI_STAT_AUTO_ALERTS,
+};
+
+static void vmmci_count_add(struct virtio_vmmci *vmmci,
+			    enum vmmci_counter id, unsigned long n)
+{
+	this_cpu_add(vmmci->counters->v[id], n);
+}
+
+static void vmmci_count(struct virtio_vmmci *vmmci, enum vmmci_counter id)
+{
+	this_cpu_inc(vmmci->counters->v[id]);
+}
+
+static unsigned long vmmci_counter_sum(struct virtio_vmmci *vmmci,
+				       enum vmmci_counter id)
+{
+	unsigned long sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(vmmci->counters, cpu)->v[id];
+	return sum;
+}
+
+static s64 vmmci_stat(struct virtio_vmmci *vmmci, enum vmmci_stat stat)
+{
+	struct vmmci_drift_state st;
+	struct timespec64 diff;
+
+	switch (stat) {
+	case VMMCI_STAT_DRIFT_SEC:
+	case VMMCI_STAT_DRIFT_NSEC:
+		drift_state_read(&vmmci->drift_lock, &vmmci->drift, &st);
+		diff = ns_to_timespec64(st.offset);
+		return stat == VMMCI_STAT_DRIFT_SEC ? diff.tv_sec : diff.tv_nsec;
+	case VMMCI_STAT_DELAY:
+		drift_state_read(&vmmci->drift_lock, &vmmci->drift, &st);
+		return st.delay;
+	case VMMCI_STAT_ACK_LATENCY:
+		return READ_ONCE(vmmci->ack_latency);
+	case VMMCI_STAT_ACK_LATENCY_MAX:
+		return READ_ONCE(vmmci->ack_latency_max);
+	case VMMCI_STAT_FREQ_PPB:
+		return READ_ONCE(vmmci->freq_ppb);
+	case VMMCI_STAT_TSC_SKEW_PPB:
+		return READ_ONCE(vmmci->tsc_skew_ppb);
+	case VMMCI_STAT_TIME_RETRIES:
+		return vmmci_counter_sum(vmmci, VMMCI_CNT_TIME_RETRIES);
+	case VMMCI_STAT_SYNC_REQUESTS:
+		return atomic_long_read(&vmmci->sync_requests);
+	case VMMCI_STAT_SYNC_COALESCED:
+		return atomic_long_read(&vmmci->sync_coalesced);
+	case VMMCI_STAT_SYNC_RUNS:
+		return atomic_long_read(&vmmci->sync_runs);
+	case VMMCI_STAT_AUTO_SLEWS:
+		return atomic_long_read(&vmmci->auto_slews);
+	case VMMCI_STAT_AUTO_STEPS:
+		return atomic_long_read(&vmmci->auto_steps);
+	case VMMCI_STAT_AUTO_ALERTS:
+		return atomic_long_read(&vmmci->auto_alerts);
+	}
+	return 0;
+}
+
+/* The sysctls predate support for more than one device, so they're only
+ * a view of the first device probed. Everything per device is in sysfs.
+ */
+static LIST_HEAD(vmmci_devices);
+static DEFINE_MUTEX(vmmci_devices_lock);
+
+static struct ctl_table_header *vmmci_table_header;
+
+/* Formats a value of the first device, or 0 without one, and hands it
+ * on to proc_dostring. The device can't go away while we hold the lock.
+ */
+static int proc_vmmci(struct ctl_table *table, int write,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0)
+		      void __user *buffer,
+#else
+		      void *buffer,
+#endif
+		      size_t *lenp, loff_t *ppos)
+{
+	struct vmmci_drift_state st = { 0 };
+	struct virtio_vmmci *vmmci;
+	struct ctl_table t = *table;
+	long stat = (long) table->extra1;
+	char buf[96];
+
+	mutex_lock(&vmmci_devices_lock);
+	vmmci = list_first_entry_or_null(&vmmci_devices, struct virtio_vmmci,
+	    node);
+	if (stat < 0) {
+		if (vmmci)
+			drift_state_read(&vmmci->drift_lock, &vmmci->drift, &st);
+		drift_state_format(&st, buf, sizeof(buf));
+	} else {
+		snprintf(buf, sizeof(buf), "%lld",
+		    vmmci ? vmmci_stat(vmmci, stat) : 0);
+	}
+	mutex_unlock(&vmmci_devices_lock);
+
+	t.data = buf;
+	t.maxlen = sizeof(buf);
+	return proc_dostring(&t, write, buffer, lenp, ppos);
+}
+
+#define VMMCI_SYSCTL(_name, _stat) {			\
+	.procname	= _name,			\
+	.mode		= 0444,				\
+	.extra1		= (void *) (long) (_stat),	\
+	.proc_handler	= &proc_vmmci,			\
+}
+
+static struct ctl_table drift_table[] = {
+	VMMCI_SYSCTL("drift", -1),
+	VMMCI_SYSCTL("drift_sec", VMMCI_STAT_DRIFT_SEC),
+	VMMCI_SYSCTL("drift_nsec", VMMCI_STAT_DRIFT_NSEC),
+	VMMCI_SYSCTL("ack_latency_nsec", VMMCI_STAT_ACK_LATENCY),
+	VMMCI_SYSCTL("ack_latency_max_nsec", VMMCI_STAT_ACK_LATENCY_MAX),
+	VMMCI_SYSCTL("delay_nsec", VMMCI_STAT_DELAY),
+	VMMCI_SYSCTL("freq_ppb", VMMCI_STAT_FREQ_PPB),
+	VMMCI_SYSCTL("tsc_skew_ppb", VMMCI_STAT_TSC_SKEW_PPB),
+	VMMCI_SYSCTL("time_retries", VMMCI_STAT_TIME_RETRIES),
+	VMMCI_SYSCTL("sync_requests", VMMCI_STAT_SYNC_REQUESTS),
+	VMMCI_SYSCTL("sync_coalesced", VMMCI_STAT_SYNC_COALESCED),
+	VMMCI_SYSCTL("sync_runs", VMMCI_STAT_SYNC_RUNS),
+	VMMCI_SYSCTL("auto_slews", VMMCI_STAT_AUTO_SLEWS),
+	VMMCI_SYSCTL("auto_steps", VMMCI_STAT_AUTO_STEPS),
+	VMMCI_SYSCTL("auto_alerts", VMMCI_STAT_AUTO_ALERTS),
+	{ },
+};
+
+static struct ctl_table vmmci_table = {
+	.procname	= "vmmci",
+	.child		= drift_table,
+};
+
+static struct virtio_device_id id_table[] = {
+	{ VIRTIO_ID_VMMCI, VIRTIO_DEV_ANY_ID },
+	{ 0 },
+};
+
+static unsigned int features[] = {
+	VMMCI_F_TIMESYNC, VMMCI_F_ACK, VMMCI_F_SYNCRTC, VMMCI_F_EVENTQ,
+	VMMCI_F_REPORT,
+};
+
+static void vmmci_hist_add(struct virtio_vmmci *vmmci, enum vmmci_hist_id id,
+			   s64 ns)
+{
+	struct vmmci_hist *h = &vmmci->hist[id];
+	s64 max, old;
+	int b = 0;
+
+	if (ns < 0)
+		ns = 0;
+	if (ns > 0)
+		b = min_t(int, fls64(ns) - 1, VMMCI_HIST_BUCKETS - 1);
+
+	atomic64_inc(&h->buckets[b]);
+	atomic64_inc(&h->count);
+	atomic64_add(ns, &h->sum);
+
+	max = atomic64_read(&h->max);
+	while (ns > max) {
+		old = atomic64_cmpxchg(&h->max, max, ns);
+		if (old == max)
+			break;
+		max = old;
+	}
+}
+
+static void vmmci_hist_since(struct virtio_vmmci *vmmci, enum vmmci_hist_id id,
+			     ktime_t start)
+{
+	vmmci_hist_add(vmmci, id, ktime_to_ns(ktime_sub(ktime_get(), start)));
+}
+
+/* Config space accessors, timed per access width */
+static int vmmci_width_hist(unsigned int len, enum vmmci_hist_id base)
+{
+	switch (len) {
+	case 1:
+		return base;
+	case 2:
+		return base + 1;
+	case 4:
+		return base + 2;
+	case 8:
+		return base + 3;
+	}
+	return -1;
+}
+
+static void vmmci_get(struct virtio_vmmci *vmmci, unsigned int offset,
+		      void *buf, unsigned int len)
+{
+	ktime_t start = ktime_get();
+	int id;
+
+	vmmci->vdev->config->get(vmmci->vdev, offset, buf, len);
+
+	id = vmmci_width_hist(len, VMMCI_HIST_GET_1);
+	if (len == sizeof(struct vmmci_time_snapshot))
+		id = VMMCI_HIST_GET_TIME;
+	if (id >= 0)
+		vmmci_hist_since(vmmci, id, start);
+}
+
+static void vmmci_set(struct virtio_vmmci *vmmci, unsigned int offset,
+		      const void *buf, unsigned int len)
+{
+	ktime_t start = ktime_get();
+	int id;
+
+	vmmci->vdev->config->set(vmmci->vdev, offset, buf, len);
+
+	id = vmmci_width_hist(len, VMMCI_HIST_SET_1);
+	if (id >= 0)
+		vmmci_hist_since(vmmci, id, start);
+}
+
+
+/* Generic netlink events, so agents can block on a socket instead of
+ * polling sysctls or scraping dmesg. See virtio_vmmci_uapi.h for the
+ * message format. Nothing is allocated unless somebody is listening.
+ */
+static const struct genl_multicast_group vmmci_nl_mcgrps[] = {
+	{ .name = VMMCI_GENL_MCGRP_EVENTS, },
+};
+
+static struct genl_family vmmci_nl_family = {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,10,0)
+	.id		= GENL_ID_GENERATE,
+#endif
+	.name		= VMMCI_GENL_NAME,
+	.version	= VMMCI_GENL_VERSION,
+	.maxattr	= VMMCI_ATTR_MAX,
+	.module		= THIS_MODULE,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+	.mcgrps		= vmmci_nl_mcgrps,
+	.n_mcgrps	= ARRAY_SIZE(vmmci_nl_mcgrps),
+#endif
+};
+
+static int vmmci_nl_register(void)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,10,0)
+	return _genl_register_family_with_ops_grps(&vmmci_nl_family, NULL, 0,
+	    vmmci_nl_mcgrps, ARRAY_SIZE(vmmci_nl_mcgrps));
+#else
+	return genl_register_family(&vmmci_nl_family);
+#endif
+}
+
+/* Starts an event message, or returns NULL if there's no one to tell.
+ * These can be sent from interrupt context, hence GFP_ATOMIC.
+ */
+static struct sk_buff *vmmci_nl_start(struct virtio_vmmci *vmmci, u8 event,
+				      void **hdr)
+{
+	struct sk_buff *msg;
+
+	if (!genl_has_listeners(&vmmci_nl_family, &init_net, 0))
+		return NULL;
+
+	msg = genlmsg_new(NLMSG_GOODSIZE, GFP_ATOMIC);
+	if (msg == NULL)
+		return NULL;
+
+	*hdr = genlmsg_put(msg, 0, 0, &vmmci_nl_family, 0, event);
+	if (*hdr == NULL
+	    || nla_put_string(msg, VMMCI_ATTR_DEVICE, dev_name(&vmmci->vdev->dev))) {
+		nlmsg_free(msg);
+		return NULL;
+	}
+
+	return msg;
+}
+
+static void vmmci_nl_send(struct sk_buff *msg, void *hdr)
+{
+	genlmsg_end(msg, hdr);
+	genlmsg_multicast(&vmmci_nl_family, msg, 0, 0, GFP_ATOMIC);
+}
+
+static void vmmci_nl_command(struct virtio_vmmci *vmmci, u32 cmd, bool acked)
+{
+	struct sk_buff *msg;
+	void *hdr;
+
+	msg = vmmci_nl_start(vmmci, VMMCI_EVENT_COMMAND, &hdr);
+	if (msg == NULL)
+		return;
+
+	if (nla_put_u32(msg, VMMCI_ATTR_COMMAND, cmd)
+	    || (acked && nla_put_flag(msg, VMMCI_ATTR_ACKED))) {
+		nlmsg_free(msg);
+		return;
+	}
+	vmmci_nl_send(msg, hdr);
+}
+
+static void vmmci_nl_sync(struct virtio_vmmci *vmmci, int rc,
+			  s64 before, s64 after)
+{
+	struct sk_buff *msg;
+	void *hdr;
+
+	msg = vmmci_nl_start(vmmci, VMMCI_EVENT_SYNC, &hdr);
+	if (msg == NULL)
+		return;
+
+	if (nla_put_s32(msg, VMMCI_ATTR_ERROR, rc)
+	    || nla_put_s64(msg, VMMCI_ATTR_OFFSET_BEFORE, before, VMMCI_ATTR_PAD)
+	    || nla_put_s64(msg, VMMCI_ATTR_OFFSET_AFTER, after, VMMCI_ATTR_PAD)) {
+		nlmsg_free(msg);
+		return;
+	}
+	vmmci_nl_send(msg, hdr);
+}
+
+static void vmmci_nl_sample(struct virtio_vmmci *vmmci,
+			    const struct vmmci_sample *sample)
+{
+	struct sk_buff *msg;
+	void *hdr;
+
+	msg = vmmci_nl_start(vmmci, VMMCI_EVENT_SAMPLE, &hdr);
+	if (msg == NULL)
+		return;
+
+	if (nla_put_s64(msg, VMMCI_ATTR_HOST_NS, sample->host, VMMCI_ATTR_PAD)
+	    || nla_put_s64(msg, VMMCI_ATTR_GUEST_NS, sample->guest, VMMCI_ATTR_PAD)
+	    || nla_put_s64(msg, VMMCI_ATTR_OFFSET, sample->offset, VMMCI_ATTR_PAD)
+	    || nla_put_s64(msg, VMMCI_ATTR_DELAY, sample->delay, VMMCI_ATTR_PAD)
+	    || nla_put_s64(msg, VMMCI_ATTR_FREQ_PPB, vmmci->freq_ppb,
+	    VMMCI_ATTR_PAD)) {
+		nlmsg_free(msg);
+		return;
+	}
+	vmmci_nl_send(msg, hdr);
+}
+
+/* Reports an error, with the command it concerns if cmd isn't VMMCI_NONE */
+static void vmmci_nl_error(struct virtio_vmmci *vmmci, int err, u32 cmd)
+{
+	struct sk_buff *msg;
+	void *hdr;
+
+	msg = vmmci_nl_start(vmmci, VMMCI_EVENT_ERROR, &hdr);
+	if (msg == NULL)
+		return;
+
+	if (nla_put_s32(msg, VMMCI_ATTR_ERROR, err)
+	    || (cmd != VMMCI_NONE && nla_put_u32(msg, VMMCI_ATTR_COMMAND, cmd))) {
+		nlmsg_free(msg);
+		return;
+	}
+	vmmci_nl_send(msg, hdr);
+}
+
+/* Reads the host clock in one consistent snapshot via the transport. */
+static void read_host_time(struct virtio_vmmci *vmmci,
+			   struct timespec64 *host)
+{
+	struct vmmci_time_snapshot snap;
+
+	vmmci_get(vmmci, VMMCI_CONFIG_TIME_SEC, &snap, sizeof(snap));
+
+	if (snap.retries) {
+		vmmci_count_add(vmmci, VMMCI_CNT_TIME_RETRIES, snap.retries);
+		debug("host time read torn, retried %u time(s) in %u reads\n",
+		    snap.retries, snap.reads);
+	}
+
+	host->tv_sec = snap.sec;
+	host->tv_nsec = (long) snap.usec * NSEC_PER_USEC;
+}
+
+/* Steps the system clock by offset nanoseconds. */
+static int step_clock(s64 offset)
+{
+	struct timespec64 time;
+
+	KUNIT_STATIC_STUB_REDIRECT(step_clock, offset);
+
+	// Setting the system clock using do_settimeofday64 should be safe
+	// as it is similar to OpenBSD's tc_setclock that steps the system
+	// clock while triggering any alarms/timeouts that should fire
+	getnstimeofday64(&time);
+	time = timespec64_add(time, ns_to_timespec64(offset));
+
+	return do_settimeofday64(&time);
+}
+
+/* Hands offset nanoseconds to the kernel's NTP code to be slewed away
+ * like adjtime(3) does. The kernel slews at up to 500 ppm, so this never
+ * makes time go backwards. It does replace any adjustment in progress,
+ * which is what we want when re-issuing from a fresher measurement.
+ */
+static int slew_clock(s64 offset)
+{
+	vmmci_timex_t txc = {
+		.modes	= ADJ_OFFSET_SINGLESHOT,
+		.offset	= div_s64(offset, NSEC_PER_USEC),
+	};
+	int rc;
+
+	KUNIT_STATIC_STUB_REDIRECT(slew_clock, offset);
+
+	if (!resolve_adjtimex())
+		return -EOPNOTSUPP;
+
+	rc = vmmci_adjtimex(&txc);
+	return rc < 0 ? rc : 0;
+}
+
+/* Sets the kernel's frequency correction like adjtimex(8) --frequency */
+static int set_frequency(s64 ppb)
+{
+	vmmci_timex_t txc = {
+		.modes	= ADJ_FREQUENCY,
+	};
+	int rc;
+
+	if (!resolve_adjtimex())
+		return -EOPNOTSUPP;
+
+	ppb = clamp_t(s64, ppb, -VMMCI_FREQ_MAX_PPB, VMMCI_FREQ_MAX_PPB);
+	// the kernel wants ppm with a 16 bit fractional part
+	txc.freq = div_s64(ppb << 16, 1000);
+
+	rc = vmmci_adjtimex(&txc);
+	return rc < 0 ? rc : 0;
+}
+
+/* Corrects the system clock by offset nanoseconds according to the
+ * device's correction mode.
+ */
+static int correct_clock(struct virtio_vmmci *vmmci, s64 offset)
+{
+	s64 threshold = (s64) vmmci->step_threshold_us * NSEC_PER_USEC;
+	int rc;
+
+	if (vmmci->correct_mode == VMMCI_CORRECT_SLEW
+	    && abs(offset) <= threshold) {
+		rc = slew_clock(offset);
+		if (rc == 0) {
+			vmmci->slewing = abs(offset) > VMMCI_SLEW_DONE_NS;
+			debug("slewing clock by %lld ns\n", offset);
+			return 0;
+		}
+		printk_once(KERN_WARNING "vmmci: unable to slew clock (%d), "
+		    "stepping instead\n", rc);
+	}
+
+	vmmci->slewing = false;
+	rc = step_clock(offset);
+	if (rc == 0)
+		debug("stepped clock by %lld ns\n", offset);
+
+	return rc;
+}
+
+/* Measures the host clock against ours. The host timestamp is taken
+ * somewhere between our two readings, so assume it was the middle.
+ */
+static void take_sample(struct virtio_vmmci *vmmci, struct vmmci_sample *sample)
+{
+	struct system_time_snapshot before, after;
+	struct timespec64 host;
+	u64 tsc = 0;
+
+	ktime_get_snapshot(&before);
+#ifdef CONFIG_X86
+	tsc = rdtsc_ordered();
+#endif
+	read_host_time(vmmci, &host);
+#ifdef CONFIG_X86
+	tsc += (rdtsc_ordered() - tsc) / 2;
+#endif
+	ktime_get_snapshot(&after);
+
+	sample->delay = ktime_to_ns(ktime_sub(after.raw, before.raw));
+	sample->guest = ktime_to_ns(before.real) + sample->delay / 2;
+	sample->raw = ktime_to_ns(before.raw) + sample->delay / 2;
+	sample->host = timespec64_to_ns(&host);
+	sample->offset = sample->host - sample->guest;
+	sample->tsc = tsc;
+}
+
+/* Takes a burst of samples, keeping the one with the smallest round-trip */
+static void take_best_sample(struct virtio_vmmci *vmmci,
+			     struct vmmci_sample *best)
+{
+	struct vmmci_sample sample;
+	unsigned int i, n = READ_ONCE(burst);
+
+	take_sample(vmmci, best);
+	for (i = 1; i < n; i++) {
+		take_sample(vmmci, &sample);
+		if (sample.delay < best->delay)
+			*best = sample;
+	}
+}
+
+/* Synchronizes the system time to the host clock as read from the vmmci
+ * time registers.
+ */
+static int sync_from_host(struct virtio_vmmci *vmmci,
+			  const struct vmmci_sample *sample)
+{
+	int rc;
+
+	rc = correct_clock(vmmci, sample->offset);
+	if (rc) {
+		printk(KERN_ERR "vmmci failed to set system clock to host time!\n");
+		return rc;
+	}
+	log("corrected system clock by %lld ns to host time (read took %lld ns)\n",
+	    sample->offset, sample->delay);
+
+	return 0;
+}
+
+/* Synchronizes the system time to the hardware clock (rtc). Uses a process
+ * similar to the one performed by the kernel at startup as defined in
+ * the Linux kernel source file /drivers/rtc/hctosys.c. Minus the 32-bit
+ * and non-amd64 specific stuff.
+ *
+ * The rtc only has second resolution, so this is just a fallback for
+ * hosts that don't offer TIMESYNC.
+ */
+static int sync_from_rtc(struct virtio_vmmci *vmmci)
+{
+	int rc = -1;
+	struct rtc_time hw_tm;
+	struct timespec64 time = {
+		.tv_nsec = NSEC_PER_SEC >> 1,
+	};
+
+	// Try to open the hardware clock...which should be the emulated
+	// mc146818 clock device. Hang on to it so we don't have to look
+	// it up again on every sync request.
+	if (vmmci->rtc == NULL)
+		vmmci->rtc = rtc_class_open(CONFIG_RTC_HCTOSYS_DEVICE);
+	if (vmmci->rtc == NULL) {
+		vmmci_count(vmmci, VMMCI_CNT_RTC_OPEN_FAILED);
+		printk(KERN_ERR "vmmci unable to open rtc device\n");
+		return -ENODEV;
+	}
+
+	// Reading the rtc device should be the same as getting the host
+	// time via the vmmci config registers...just without all the
+	// nastiness
+	rc = rtc_read_time(vmmci->rtc, &hw_tm);
+	if (rc) {
+		printk(KERN_ERR "vmmci failed to read the hardware clock\n");
+		return rc;
+	}
+	time.tv_sec = rtc_tm_to_time64(&hw_tm);
+
+	rc = do_settimeofday64(&time);
+	if (rc) {
+		printk(KERN_ERR "vmmci failed to set system clock to rtc!\n");
+		return rc;
+	}
+	log("set system clock to %d-%02d-%02d %02d:%02d:%02d UTC\n",
+	    hw_tm.tm_year + 1900, hw_tm.tm_mon + 1, hw_tm.tm_mday,
+	    hw_tm.tm_hour, hw_tm.tm_min, hw_tm.tm_sec);
+
+	return 0;
+}
+
+/* Synchronizes the system time, measuring the offset from the host before
+ * and after if the host lets us read its clock.
+ */
+static int sync_system_time(struct virtio_vmmci *vmmci, s64 *before, s64 *after)
+{
+	bool timesync = virtio_has_feature(vmmci->vdev, VMMCI_F_TIMESYNC);
+	struct vmmci_sample sample;
+	int rc;
+
+	*before = *after = 0;
+	if (timesync) {
+		take_best_sample(vmmci, &sample);
+		*before = sample.offset;
+	}
+
+	if (timesync && sync_source == VMMCI_SYNC_HOST)
+		rc = sync_from_host(vmmci, &sample);
+	else
+		rc = sync_from_rtc(vmmci);
+
+	if (timesync) {
+		take_sample(vmmci, &sample);
+		*after = sample.offset;
+	}
+
+	vmmci_count(vmmci, rc ? VMMCI_CNT_SYNC_FAILED : VMMCI_CNT_SYNC_OK);
+	return rc;
+}
+
+/* Hands the latest drift and sync outcome to the host, if it asked for
+ * them. Called by the monitor and sync work, which may run at the same
+ * time, hence the mutex around the sequence.
+ */
+static void vmmci_report(struct virtio_vmmci *vmmci)
+{
+	struct vmmci_drift_state st;
+	__le32 l;
+	__le64 q;
+
+	if (!READ_ONCE(report_drift)
+	    || !virtio_has_feature(vmmci->vdev, VMMCI_F_REPORT))
+		return;
+
+	drift_state_read(&vmmci->drift_lock, &vmmci->drift, &st);
+
+	mutex_lock(&vmmci->report_lock);
+	if (st.samples)
+		vmmci->report_status |= VMMCI_REPORT_VALID;
+
+	l = cpu_to_le32(++vmmci->report_seq);
+	vmmci_set(vmmci, VMMCI_CONFIG_REPORT_SEQ, &l, sizeof(l));
+	l = cpu_to_le32(vmmci->report_status);
+	vmmci_set(vmmci, VMMCI_CONFIG_REPORT_STATUS, &l, sizeof(l));
+	q = cpu_to_le64(st.offset);
+	vmmci_set(vmmci, VMMCI_CONFIG_REPORT_OFFSET, &q, sizeof(q));
+	q = cpu_to_le64(st.delay);
+	vmmci_set(vmmci, VMMCI_CONFIG_REPORT_DELAY, &q, sizeof(q));
+	q = cpu_to_le64(vmmci->report_sync);
+	vmmci_set(vmmci, VMMCI_CONFIG_REPORT_SYNC, &q, sizeof(q));
+	l = cpu_to_le32(++vmmci->report_seq);
+	vmmci_set(vmmci, VMMCI_CONFIG_REPORT_SEQ, &l, sizeof(l));
+	mutex_unlock(&vmmci->report_lock);
+}
+
+static void vmmci_report_sync(struct virtio_vmmci *vmmci, int rc)
+{
+	mutex_lock(&vmmci->report_lock);
+	vmmci->report_sync = ktime_get_real_ns();
+	if (rc) {
+		vmmci->report_status |= VMMCI_REPORT_SYNC_FAILED;
+	} else {
+		vmmci->report_status |= VMMCI_REPORT_SYNCED;
+		vmmci->report_status &= ~VMMCI_REPORT_SYNC_FAILED;
+	}
+	mutex_unlock(&vmmci->report_lock);
+
+	vmmci_report(vmmci);
+}
+
+/* The monitor and drift history are further down. The history marks
+ * the sample a sync followed, and the monitor is re-armed after it. */
+static void vmmci_drift_mark_sync(struct virtio_vmmci *vmmci);
+static void monitor_tighten(struct virtio_vmmci *vmmci);
+
+static void sync_work_func(struct work_struct *work)
+{
+	struct virtio_vmmci *vmmci;
+	s64 before, after;
+	ktime_t start;
+	int rc = 0;
+
+	vmmci = container_of(to_delayed_work(work), struct virtio_vmmci,
+	    sync_work);
+	WRITE_ONCE(vmmci->sync_last, jiffies);
+	WRITE_ONCE(vmmci->sync_ran, true);
+	atomic_long_inc(&vmmci->sync_runs);
+
+	debug("starting clock synchronization...");
+	trace_vmmci_sync_start(vmmci->vdev->index);
+	start = ktime_get();
+	mutex_lock(&vmmci->correct_lock);
+	rc = sync_system_time(vmmci, &before, &after);
+	mutex_unlock(&vmmci->correct_lock);
+	vmmci_hist_since(vmmci, VMMCI_HIST_SYNC, start);
+	trace_vmmci_sync_end(vmmci->vdev->index, rc, before, after);
+	if (rc)
+		debug("clock synchronization failed (%d)\n", rc);
+	else
+		debug("finished clock synchronization! (offset %lld ns -> %lld ns)\n",
+		    before, after);
+
+	vmmci_nl_sync(vmmci, rc, before, after);
+	if (!rc)
+		vmmci_drift_mark_sync(vmmci);
+	vmmci_report_sync(vmmci, rc);
+	monitor_tighten(vmmci);
+}
+
+/* Asks for a sync, folding it into one that's already pending and
+ * holding it back until sync_min_interval_ms after the last one started.
+ * A request while a sync runs gets a sync of its own afterwards, since
+ * the running one may have read the host clock already.
+ */
+static void vmmci_request_sync(struct virtio_vmmci *vmmci)
+{
+	unsigned long next, delay = 0;
+
+	if (READ_ONCE(vmmci->stopping))
+		return;
+
+	atomic_long_inc(&vmmci->sync_requests);
+
+	if (READ_ONCE(vmmci->sync_ran)) {
+		next = READ_ONCE(vmmci->sync_last)
+		    + msecs_to_jiffies(READ_ONCE(sync_min_interval_ms));
+		if (time_before(jiffies, next))
+			delay = next - jiffies;
+	}
+
+	if (!queue_delayed_work(vmmci_wq, &vmmci->sync_work, delay))
+		atomic_long_inc(&vmmci->sync_coalesced);
+}
+
+/* Syncs right away, regardless of the rate limit, and waits for it */
+static void vmmci_sync_now(struct virtio_vmmci *vmmci)
+{
+	atomic_long_inc(&vmmci->sync_requests);
+	mod_delayed_work(vmmci_wq, &vmmci->sync_work, 0);
+	flush_delayed_work(&vmmci->sync_work);
+}
+
+/* Fits the frequency error over the sliding window of samples, using a
+ * least squares fit of how host time moves against our raw clock. Raw
+ * time isn't touched by steps, slews or frequency corrections, so those
+ * don't disturb the fit. A jump the frequency can't explain (the host
+ * stepping its clock, or being suspended) starts the window over.
+ *
+ * x is kept in milliseconds and y in nanoseconds, so y/x is ppm. The fit
+ * is over the deviations from the means, each at most the span S (in ms)
+ * or, since every step between points passed the discontinuity check,
+ * 500 S + 32 ms worth of ns. With S capped at VMMCI_FREQ_SPAN_MAX_MS that
+ * keeps 32 of their products under 4e18, within s64.
+ */
+static void update_freq(struct virtio_vmmci *vmmci,
+			const struct vmmci_sample *sample)
+{
+	struct vmmci_freq_point p, *prev, *q;
+	s64 sx = 0, sy = 0, sxy = 0, sxx = 0;
+	int ppb;
+	s64 n, dx, dy, mx, my;
+	unsigned int i, window = READ_ONCE(freq_window);
+
+	p.x = div_s64(sample->raw, NSEC_PER_MSEC);
+	p.y = sample->host - sample->raw;
+
+	if (vmmci->freq_count) {
+		prev = &vmmci->freq_points[(vmmci->freq_head + VMMCI_FREQ_WINDOW_MAX - 1)
+		    % VMMCI_FREQ_WINDOW_MAX];
+		dx = p.x - prev->x;
+		dy = p.y - prev->y;
+		if (dx <= 0 || abs(dy) > dx * (VMMCI_FREQ_MAX_PPB / 1000) + NSEC_PER_MSEC) {
+			debug("discontinuity of %lld ns, restarting frequency fit\n", dy);
+			vmmci->freq_count = 0;
+		}
+	}
+
+	vmmci->freq_points[vmmci->freq_head] = p;
+	vmmci->freq_head = (vmmci->freq_head + 1) % VMMCI_FREQ_WINDOW_MAX;
+	if (vmmci->freq_count < window)
+		vmmci->freq_count++;
+	else
+		vmmci->freq_count = window;
+
+	if (vmmci->freq_count < VMMCI_FREQ_MIN_SAMPLES)
+		return;
+
+	// the means, relative to the newest point
+	for (n = 0; n < vmmci->freq_count; n++) {
+		q = &vmmci->freq_points[(vmmci->freq_head + VMMCI_FREQ_WINDOW_MAX - 1 - n)
+		    % VMMCI_FREQ_WINDOW_MAX];
+		if (p.x - q->x > VMMCI_FREQ_SPAN_MAX_MS)
+			break;
+		sx += q->x - p.x;
+		sy += q->y - p.y;
+	}
+	if (n < VMMCI_FREQ_MIN_SAMPLES)
+		return;
+	mx = div_s64(sx, n);
+	my = div_s64(sy, n);
+
+	// and the fit over the deviations from them
+	for (i = 0; i < n; i++) {
+		q = &vmmci->freq_points[(vmmci->freq_head + VMMCI_FREQ_WINDOW_MAX - 1 - i)
+		    % VMMCI_FREQ_WINDOW_MAX];
+		dx = q->x - p.x - mx;
+		dy = q->y - p.y - my;
+		sxy += dx * dy;
+		sxx += dx * dx;
+	}
+	if (sxx < 1000)
+		return;
+
+	// ns per ms is ppm, so scale the denominator for ppb
+	ppb = clamp_t(s64, div64_s64(sxy, sxx / 1000),
+	    -VMMCI_FREQ_MAX_PPB, VMMCI_FREQ_MAX_PPB);
+	WRITE_ONCE(vmmci->freq_ppb, ppb);
+	debug("estimated frequency error: %d ppb over %lld samples\n", ppb, n);
+
+	if (READ_ONCE(freq_correct) && set_frequency(ppb))
+		printk_once(KERN_WARNING "vmmci: unable to set clock frequency\n");
+}
+
+/* The time page behind /dev/vmmci, letting userspace compute host time
+ * without a syscall (see virtio_vmmci_uapi.h). There's only one device
+ * node, so only the first vmmci device publishes to it.
+ */
+static struct vmmci_time_page *time_page;
+static struct virtio_vmmci *time_page_owner;
+static DEFINE_MUTEX(time_page_lock);
+
+static void publish_time_page(struct virtio_vmmci *vmmci,
+			      const struct vmmci_sample *sample)
+{
+	struct vmmci_time_page *page = time_page;
+
+	if (page == NULL || time_page_owner != vmmci)
+		return;
+
+	WRITE_ONCE(page->seq, page->seq + 1);
+	smp_wmb();
+
+	page->samples++;
+	page->host_ns = sample->host;
+	page->guest_real_ns = sample->guest;
+	page->guest_mono_ns = sample->guest - ktime_to_ns(ktime_mono_to_real(0));
+	page->guest_raw_ns = sample->raw;
+	page->guest_tsc = sample->tsc;
+#ifdef CONFIG_X86
+	page->tsc_khz = sample->tsc ? tsc_khz : 0;
+#endif
+	page->offset_ns = sample->offset;
+	page->delay_ns = sample->delay;
+	page->freq_ppb = vmmci->freq_ppb;
+
+	smp_wmb();
+	WRITE_ONCE(page->seq, page->seq + 1);
+}
+
+/* Mappings take their own reference on the page, so it outlives the
+ * device if userspace still has it mapped.
+ */
+static int vmmci_dev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	int rc = -ENODEV;
+
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+	vma->vm_flags &= ~VM_MAYWRITE;
+#else
+	vm_flags_clear(vma, VM_MAYWRITE);
+#endif
+
+	mutex_lock(&time_page_lock);
+	if (time_page)
+		rc = vm_insert_page(vma, vma->vm_start, virt_to_page(time_page));
+	mutex_unlock(&time_page_lock);
+
+	return rc;
+}
+
+static const struct file_operations vmmci_dev_fops = {
+	.owner		= THIS_MODULE,
+	.mmap		= vmmci_dev_mmap,
+	.llseek		= noop_llseek,
+};
+
+static struct miscdevice vmmci_miscdev = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= "vmmci",
+	.fops		= &vmmci_dev_fops,
+	.mode		= 0444,
+};
+
+static void vmmci_time_page_register(struct virtio_vmmci *vmmci)
+{
+	if (time_page_owner)
+		return;
+
+	time_page = (struct vmmci_time_page *) get_zeroed_page(GFP_KERNEL);
+	if (time_page == NULL) {
+		printk(KERN_WARNING "vmmci: failed to alloc time page\n");
+		return;
+	}
+	time_page->version = VMMCI_TIME_PAGE_VERSION;
+
+	if (misc_register(&vmmci_miscdev)) {
+		printk(KERN_WARNING "vmmci: failed to register %s\n",
+		    VMMCI_DEVICE_PATH);
+		free_page((unsigned long) time_page);
+		time_page = NULL;
+		return;
+	}
+
+	time_page_owner = vmmci;
+}
+
+static void vmmci_time_page_unregister(struct virtio_vmmci *vmmci)
+{
+	if (time_page_owner != vmmci)
+		return;
+
+	misc_deregister(&vmmci_miscdev);
+
+	// existing mappings hold their own reference to the page
+	mutex_lock(&time_page_lock);
+	free_page((unsigned long) time_page);
+	time_page = NULL;
+	time_page_owner = NULL;
+	mutex_unlock(&time_page_lock);
+}
+
+/* Measures how far the TSC strayed from the host clock since the last
+ * sample, which is what the clocksource watchdog would be judging it on.
+ */
+static void update_tsc_skew(struct virtio_vmmci *vmmci,
+			    const struct vmmci_sample *sample)
+{
+#ifdef CONFIG_X86
+	s64 host_ns, tsc_ns;
+
+	if (!boot_cpu_has(X86_FEATURE_TSC) || !tsc_khz)
+		return;
+
+	if (vmmci->tsc_prev) {
+		host_ns = sample->host - vmmci->tsc_prev_host;
+		tsc_ns = mul_u64_u32_div(sample->tsc - vmmci->tsc_prev,
+		    NSEC_PER_MSEC, tsc_khz);
+
+		// anything over a second is the host stepping or suspending,
+		// not skew
+		if (host_ns > 0 && abs(host_ns - tsc_ns) < NSEC_PER_SEC) {
+			WRITE_ONCE(vmmci->tsc_skew_ppb, div64_s64(
+			    (host_ns - tsc_ns) * NSEC_PER_SEC, host_ns));
+			debug("tsc skew: %d ppb\n", vmmci->tsc_skew_ppb);
+		}
+	}
+
+	vmmci->tsc_prev_host = sample->host;
+	vmmci->tsc_prev = sample->tsc;
+#endif
+}
+
+static unsigned long monitor_min_interval(void)
+{
+	return max(msecs_to_jiffies(READ_ONCE(monitor_min_ms)), 1UL);
+}
+
+static unsigned long monitor_max_interval(void)
+{
+	return max(msecs_to_jiffies(READ_ONCE(monitor_max_ms)),
+	    monitor_min_interval());
+}
+
+/* Picks the delay until the next drift measurement based on how much the
+ * drift moved since the last one.
+ */
+static unsigned long monitor_next_interval(struct virtio_vmmci *vmmci,
+					   const struct vmmci_sample *sample)
+{
+	s64 stable = (s64) READ_ONCE(monitor_stable_us) * NSEC_PER_USEC;
+	unsigned long interval = vmmci->monitor_interval;
+
+	if (vmmci->monitor_has_prev
+	    && abs(sample->offset - vmmci->monitor_prev.offset) < stable)
+		interval *= 2;
+	else
+		interval = monitor_min_interval();
+
+	interval = clamp(interval, monitor_min_interval(), monitor_max_interval());
+
+	vmmci->monitor_prev = *sample;
+	vmmci->monitor_has_prev = true;
+	vmmci->monitor_interval = interval;
+
+	return interval;
+}
+
+/* Checks whether the host clock ran ahead of our raw clock since the last
+ * sample by more than a frequency error could explain, returning how far.
+ */
+static s64 host_suspended(struct virtio_vmmci *vmmci,
+			  const struct vmmci_sample *sample)
+{
+	s64 host, raw, gap;
+
+	if (!vmmci->monitor_has_prev)
+		return 0;
+
+	host = sample->host - vmmci->monitor_prev.host;
+	raw = sample->raw - vmmci->monitor_prev.raw;
+	gap = host - raw - div_s64(raw * (VMMCI_FREQ_MAX_PPB / 1000), NSEC_PER_MSEC);
+
+	if (gap < (s64) READ_ONCE(suspend_threshold_ms) * NSEC_PER_MSEC)
+		return 0;
+
+	return gap;
+}
+
+/* Applies the auto_correct policy to a fresh drift sample */
+static void auto_correct_apply(struct virtio_vmmci *vmmci,
+			       const struct vmmci_sample *sample)
+{
+	s64 offset = abs(sample->offset);
+	s64 band = (s64) READ_ONCE(auto_slew_us) * NSEC_PER_USEC;
+	s64 step = (s64) READ_ONCE(auto_step_us) * NSEC_PER_USEC;
+	s64 alert = (s64) READ_ONCE(auto_alert_ms) * NSEC_PER_MSEC;
+	unsigned long hold = msecs_to_jiffies(READ_ONCE(auto_hold_ms));
+	int rc;
+
+	if (alert && offset > alert) {
+		if (vmmci->auto_state != VMMCI_AUTO_ALERT) {
+			printk(KERN_WARNING "vmmci: clock is %lld ms off the host, "
+			    "beyond auto_alert_ms, leaving it\n",
+			    div_s64(sample->offset, NSEC_PER_MSEC));
+			atomic_long_inc(&vmmci->auto_alerts);
+			vmmci_nl_error(vmmci, -ERANGE, VMMCI_NONE);
+			vmmci->auto_state = VMMCI_AUTO_ALERT;
+		}
+		return;
+	}
+	if (vmmci->auto_state == VMMCI_AUTO_ALERT) {
+		if (alert && offset > alert / 2)
+			return;
+		vmmci->auto_state = VMMCI_AUTO_CORRECTING;
+	}
+
+	if (offset < band / 2) {
+		vmmci->auto_state = VMMCI_AUTO_SETTLED;
+		return;
+	}
+	if (vmmci->auto_state == VMMCI_AUTO_SETTLED && offset <= band)
+		return;
+
+	vmmci->auto_state = VMMCI_AUTO_CORRECTING;
+	if (vmmci->auto_ran && time_before(jiffies, vmmci->auto_last + hold))
+		return;
+	vmmci->auto_last = jiffies;
+	vmmci->auto_ran = true;
+
+	// a singleshot slew replaces whatever was left of the last one,
+	// so slewing again after the hold time just refreshes it
+	if (offset <= step) {
+		rc = slew_clock(sample->offset);
+		if (rc == 0) {
+			atomic_long_inc(&vmmci->auto_slews);
+			log("drift of %lld us, slewing clock\n",
+			    div_s64(sample->offset, NSEC_PER_USEC));
+			return;
+		}
+		printk_once(KERN_WARNING "vmmci: unable to slew clock (%d), "
+		    "stepping instead\n", rc);
+	}
+
+	rc = step_clock(sample->offset);
+	if (rc) {
+		printk(KERN_ERR "vmmci: failed to step clock (%d)\n", rc);
+		vmmci_nl_error(vmmci, rc, VMMCI_NONE);
+		return;
+	}
+	atomic_long_inc(&vmmci->auto_steps);
+	log("drift of %lld us, stepped clock\n",
+	    div_s64(sample->offset, NSEC_PER_USEC));
+}
+
+/* Appends a sample to the drift history. Only the monitor writes, so the
+ * one thing to get right is readers: each slot's seq is cleared while it's
+ * rewritten, and drift_head moves only once the slot is complete.
+ */
+static void vmmci_drift_record(struct virtio_vmmci *vmmci,
+			       struct vmmci_sample *sample)
+{
+	unsigned long n = vmmci->drift_head;
+	struct vmmci_drift_record *rec;
+
+	rec = &vmmci->drift_ring[n % VMMCI_DRIFT_RING_LEN];
+	WRITE_ONCE(rec->seq, 0);
+	smp_wmb();
+
+	rec->host_ns = sample->host;
+	rec->guest_ns = sample->guest;
+	rec->raw_ns = sample->raw;
+	rec->offset_ns = sample->offset;
+	rec->delay_ns = sample->delay;
+	rec->flags = 0;
+
+	smp_wmb();
+	WRITE_ONCE(rec->seq, n + 1);
+	smp_store_release(&vmmci->drift_head, n + 1);
+}
+
+/* Flags the newest record as followed by a sync. The monitor may be
+ * filling the next slot meanwhile, but never this one until the ring
+ * wraps around.
+ */
+static void vmmci_drift_mark_sync(struct virtio_vmmci *vmmci)
+{
+	unsigned long n = smp_load_acquire(&vmmci->drift_head);
+	struct vmmci_drift_record *rec;
+
+	if (!n)
+		return;
+
+	rec = &vmmci->drift_ring[(n - 1) % VMMCI_DRIFT_RING_LEN];
+	WRITE_ONCE(rec->flags, READ_ONCE(rec->flags) | VMMCI_DRIFT_SYNCED);
+}
+
+/* Publishes a sample as the device's current drift */
+static void publish_drift(struct virtio_vmmci *vmmci, struct vmmci_sample *sample)
+{
+	write_seqlock(&vmmci->drift_lock);
+	vmmci->drift.offset = sample->offset;
+	vmmci->drift.delay = sample->delay;
+	vmmci->drift.time = sample->host;
+	vmmci->drift.samples++;
+	write_sequnlock(&vmmci->drift_lock);
+
+	vmmci_report(vmmci);
+}
+
+/* (Re-)queues the next drift measurement, noting when it's due so the
+ * lateness of deferrable work shows up in the monitor_late histogram.
+ * Called with correct_lock held.
+ */
+static void monitor_queue(struct virtio_vmmci *vmmci, unsigned long delay)
+{
+	lockdep_assert_held(&vmmci->correct_lock);
+
+	if (READ_ONCE(vmmci->stopping))
+		return;
+
+	vmmci->monitor_due = ktime_add_ns(ktime_get(), jiffies_to_nsecs(delay));
+	mod_delayed_work(vmmci_wq, &vmmci->monitor_work, delay);
+}
+
+/* Pulls the next drift measurement in after something moved the clock.
+ * Takes correct_lock, so it can't land in the middle of a monitor run.
+ */
+static void monitor_tighten(struct virtio_vmmci *vmmci)
+{
+	mutex_lock(&vmmci->correct_lock);
+	vmmci->monitor_interval = monitor_min_interval();
+	vmmci->monitor_has_prev = false;
+
+	if (monitor)
+		monitor_queue(vmmci, monitor_min_interval());
+	mutex_unlock(&vmmci->correct_lock);
+}
+
+/* Runs our guest/host clock drift measurements and logs them to the syslog */
+static void monitor_work_func(struct work_struct *work)
+{
+	struct virtio_vmmci *vmmci;
+	struct vmmci_sample sample;
+	struct timespec64 host, guest, diff;
+	unsigned long interval;
+	s64 gap;
+
+	debug("measuring clock drift...\n");
+
+	// My god this container_of stuff seems...messy? Oh, Linux...
+	vmmci = container_of((struct delayed_work *) work, struct virtio_vmmci, monitor_work);
+	vmmci_count(vmmci, VMMCI_CNT_MONITOR_RUNS);
+
+	// a wait here for a sync counts as lateness, the sample is later
+	mutex_lock(&vmmci->correct_lock);
+	vmmci_hist_since(vmmci, VMMCI_HIST_MONITOR_LATE, vmmci->monitor_due);
+	take_best_sample(vmmci, &sample);
+	trace_vmmci_sample(vmmci->vdev->index, sample.host, sample.guest,
+	    sample.offset, sample.delay);
+	vmmci_drift_record(vmmci, &sample);
+	guest = ns_to_timespec64(sample.guest);
+	host = ns_to_timespec64(sample.host);
+
+	debug("host clock: " TIME_FMT ", guest clock: " TIME_FMT,
+	    host.tv_sec, host.tv_nsec, guest.tv_sec, guest.tv_nsec);
+
+	diff = ns_to_timespec64(sample.offset);
+	publish_drift(vmmci, &sample);
+
+	debug("current clock drift: " TIME_FMT " seconds (delay %lld ns)\n",
+	    diff.tv_sec, diff.tv_nsec, sample.delay);
+
+	gap = host_suspended(vmmci, &sample);
+	if (gap) {
+		log("host clock jumped %lld ms ahead, host suspend? resynchronizing\n",
+		    div_s64(gap, NSEC_PER_MSEC));
+		vmmci_request_sync(vmmci);
+	}
+
+	update_freq(vmmci, &sample);
+	update_tsc_skew(vmmci, &sample);
+	publish_time_page(vmmci, &sample);
+	vmmci_nl_sample(vmmci, &sample);
+
+	// keep an ongoing slew honest with the fresher measurement, or let
+	// auto_correct at it unless a suspend resync is already coming
+	if (vmmci->slewing)
+		correct_clock(vmmci, sample.offset);
+	else if (READ_ONCE(auto_correct) && !gap)
+		auto_correct_apply(vmmci, &sample);
+
+	interval = monitor_next_interval(vmmci, &sample);
+	monitor_queue(vmmci, interval);
+	mutex_unlock(&vmmci->correct_lock);
+	debug("drift measurement routine finished, next in %u ms\n",
+	    jiffies_to_msecs(interval));
+}
+
+#if IS_REACHABLE(CONFIG_PTP_1588_CLOCK)
+/* PTP hardware clock backed by the host time registers. It's read-only:
+ * the host clock isn't ours to adjust.
+ */
+static int vmmci_ptp_gettime(struct ptp_clock_info *info, struct timespec64 *ts)
+{
+	struct virtio_vmmci *vmmci = container_of(info, struct virtio_vmmci, ptp_info);
+
+	read_host_time(vmmci, ts);
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,0,0)
+/* Same as gettime, but with system timestamps bracketing the host reading
+ * so PTP_SYS_OFFSET_EXTENDED users know exactly when it was taken. */
+static int vmmci_ptp_gettimex(struct ptp_clock_info *info, struct timespec64 *ts,
+			      struct ptp_system_timestamp *sts)
+{
+	struct virtio_vmmci *vmmci = container_of(info, struct virtio_vmmci, ptp_info);
+
+	ptp_read_system_prets(sts);
+	read_host_time(vmmci, ts);
+	ptp_read_system_postts(sts);
+	return 0;
+}
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,2,0)
+static int vmmci_ptp_adjfreq(struct ptp_clock_info *info, s32 delta)
+{
+	return -EOPNOTSUPP;
+}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+static int vmmci_ptp_adjfine(struct ptp_clock_info *info, long delta)
+{
+	return -EOPNOTSUPP;
+}
+#endif
+
+static int vmmci_ptp_adjtime(struct ptp_clock_info *info, s64 delta)
+{
+	return -EOPNOTSUPP;
+}
+
+static int vmmci_ptp_settime(struct ptp_clock_info *info,
+			     const struct timespec64 *ts)
+{
+	return -EOPNOTSUPP;
+}
+
+static int vmmci_ptp_enable(struct ptp_clock_info *info,
+			    struct ptp_clock_request *rq, int on)
+{
+	return -EOPNOTSUPP;
+}
+
+static const struct ptp_clock_info vmmci_ptp_info = {
+	.owner		= THIS_MODULE,
+	.name		= "vmmci",
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,2,0)
+	.adjfreq	= vmmci_ptp_adjfreq,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+	.adjfine	= vmmci_ptp_adjfine,
+#endif
+	.adjtime	= vmmci_ptp_adjtime,
+	.gettime64	= vmmci_ptp_gettime,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,0,0)
+	.gettimex64	= vmmci_ptp_gettimex,
+#endif
+	.settime64	= vmmci_ptp_settime,
+	.enable		= vmmci_ptp_enable,
+};
+
+static void vmmci_ptp_register(struct virtio_vmmci *vmmci)
+{
+	struct ptp_clock *clock;
+
+	vmmci->ptp_info = vmmci_ptp_info;
+	clock = ptp_clock_register(&vmmci->ptp_info, &vmmci->vdev->dev);
+	if (IS_ERR_OR_NULL(clock)) {
+		printk(KERN_WARNING "vmmci: failed to register ptp clock (%ld)\n",
+		    PTR_ERR(clock));
+		return;
+	}
+
+	vmmci->ptp_clock = clock;
+	log("host clock available as ptp%d\n", ptp_clock_index(clock));
+}
+
+static void vmmci_ptp_unregister(struct virtio_vmmci *vmmci)
+{
+	if (vmmci->ptp_clock)
+		ptp_clock_unregister(vmmci->ptp_clock);
+	vmmci->ptp_clock = NULL;
+}
+#else
+static void vmmci_ptp_register(struct virtio_vmmci *vmmci)
+{
+	printk(KERN_WARNING "vmmci: kernel lacks ptp clock support\n");
+}
+
+static void vmmci_ptp_unregister(struct virtio_vmmci *vmmci)
+{
+}
+#endif
+
+/* Clocksource counting host microseconds, for the watchdog. The read goes
+ * straight to the transport: vmmci_get() and debug() both end up in
+ * ktime_get(), which must never call back into a clocksource read.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,13,0)
+static cycle_t vmmci_cs_read(struct clocksource *cs)
+#else
+static u64 vmmci_cs_read(struct clocksource *cs)
+#endif
+{
+	struct virtio_vmmci *vmmci = container_of(cs, struct virtio_vmmci, clocksource);
+	struct vmmci_time_snapshot snap;
+
+	vmmci->vdev->config->get(vmmci->vdev, VMMCI_CONFIG_TIME_SEC, &snap,
+	    sizeof(snap));
+	return (u64) snap.sec * USEC_PER_SEC + snap.usec;
+}
+
+static void vmmci_clocksource_register(struct virtio_vmmci *vmmci)
+{
+	struct clocksource *cs = &vmmci->clocksource;
+
+	cs->name = "vmmci";
+	cs->rating = VMMCI_CLOCKSOURCE_RATING;
+	cs->read = vmmci_cs_read;
+	cs->mask = CLOCKSOURCE_MASK(64);
+	// not IS_CONTINUOUS, so a kernel in oneshot tick mode won't switch
+	// to it even once the TSC is marked unstable. A periodic tick
+	// kernel can, see the watchdog parameter.
+	cs->flags = 0;
+
+	if (clocksource_register_hz(cs, USEC_PER_SEC)) {
+		printk(KERN_WARNING "vmmci: failed to register clocksource\n");
+		return;
+	}
+
+	vmmci->clocksource_registered = true;
+	log("registered host clock as clocksource watchdog\n");
+}
+
+static void vmmci_clocksource_unregister(struct virtio_vmmci *vmmci)
+{
+	if (vmmci->clocksource_registered)
+		clocksource_unregister(&vmmci->clocksource);
+	vmmci->clocksource_registered = false;
+}
+
+/* How long the last sync gets before the forced power off or reboot */
+#define VMMCI_SHUTDOWN_GRACE	(2 * HZ)
+
+enum {
+	VMMCI_SHUTDOWN_IDLE,
+	VMMCI_SHUTDOWN_PENDING,		/* waiting on userspace */
+	VMMCI_SHUTDOWN_SYNCING,		/* deadline passed, last sync */
+	VMMCI_SHUTDOWN_DONE,		/* the kernel is going down */
+};
+
+static atomic_t shutdown_state = ATOMIC_INIT(VMMCI_SHUTDOWN_IDLE);
+static bool shutdown_reboot;
+static unsigned int shutdown_deadline_s;
+
+/* Starts writing back all dirty data without waiting for it. The kernel's
+ * own emergency_sync isn't exported, so ask userspace for a sync, which a
+ * hung init doesn't stop the kernel from starting.
+ */
+static void shutdown_sync(void)
+{
+	static char *argv[] = { "/bin/sync", NULL };
+	static char *envp[] = {
+		"HOME=/", "PATH=/sbin:/bin:/usr/sbin:/usr/bin", NULL
+	};
+
+	if (call_usermodehelper(argv[0], argv, envp, UMH_WAIT_EXEC))
+		printk(KERN_ERR "vmmci: failed to start %s\n", argv[0]);
+}
+
+static void shutdown_deadline_func(struct work_struct *work);
+static DECLARE_DELAYED_WORK(shutdown_deadline_work, shutdown_deadline_func);
+
+/* Runs at the deadline, then once more after the grace period */
+static void shutdown_deadline_func(struct work_struct *work)
+{
+	const char *what = shutdown_reboot ? "reboot" : "power off";
+
+	if (atomic_cmpxchg(&shutdown_state, VMMCI_SHUTDOWN_PENDING,
+	    VMMCI_SHUTDOWN_SYNCING) == VMMCI_SHUTDOWN_PENDING) {
+		log("still up %u s after the host asked for a %s, syncing before forcing it\n",
+		    shutdown_deadline_s, what);
+		shutdown_sync();
+		queue_delayed_work(vmmci_wq, &shutdown_deadline_work,
+		    VMMCI_SHUTDOWN_GRACE);
+		return;
+	}
+
+	if (atomic_cmpxchg(&shutdown_state, VMMCI_SHUTDOWN_SYNCING,
+	    VMMCI_SHUTDOWN_DONE) != VMMCI_SHUTDOWN_SYNCING)
+		return;
+
+	log("forcing %s\n", what);
+	if (shutdown_reboot)
+		kernel_restart(NULL);
+	else
+		kernel_power_off();
+}
+
+/* Once the kernel itself is going down, whoever started it, there's
+ * nothing left to force.
+ */
+static int vmmci_reboot_notify(struct notifier_block *nb, unsigned long action,
+			       void *data)
+{
+	atomic_set(&shutdown_state, VMMCI_SHUTDOWN_DONE);
+	cancel_delayed_work(&shutdown_deadline_work);
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block vmmci_reboot_nb = {
+	.notifier_call = vmmci_reboot_notify,
+};
+
+/* Whether a kexec image is loaded, going by /sys/kernel/kexec_loaded
+ * since kexec_image isn't exported. No file means no kexec support.
+ */
+static bool kexec_image_loaded(void)
+{
+	struct file *f;
+	loff_t pos = 0;
+	char c = '0';
+
+	f = filp_open("/sys/kernel/kexec_loaded", O_RDONLY, 0);
+	if (IS_ERR(f))
+		return false;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,14,0)
+	kernel_read(f, pos, &c, 1);
+#else
+	kernel_read(f, &c, 1, &pos);
+#endif
+	filp_close(f, NULL);
+
+	return c == '1';
+}
+
+/* Starts kexec_reboot_cmd, returning false if the host should get a
+ * regular reboot instead.
+ */
+static bool kexec_reboot_start(void)
+{
+	static char *envp[] = {
+		"HOME=/", "PATH=/sbin:/bin:/usr/sbin:/usr/bin", NULL
+	};
+	char **argv;
+	int argc, rc;
+
+	if (!kexec_image_loaded()) {
+		log("no kexec image loaded, rebooting through the firmware\n");
+		return false;
+	}
+
+	argv = argv_split(GFP_KERNEL, kexec_reboot_cmd, &argc);
+	if (!argv || !argc) {
+		argv_free(argv);
+		printk(KERN_ERR "vmmci: kexec_reboot_cmd is empty\n");
+		return false;
+	}
+
+	rc = call_usermodehelper(argv[0], argv, envp, UMH_WAIT_EXEC);
+	if (rc)
+		printk(KERN_ERR "vmmci: failed to start %s (%d), rebooting through the firmware\n",
+		    argv[0], rc);
+	else
+		log("rebooting into the loaded kexec image\n");
+	argv_free(argv);
+
+	return rc == 0;
+}
+
+/* Hands the shutdown or reboot to userspace, arming the deadline first
+ * if there is one. Repeated commands keep the first deadline.
+ */
+static void shutdown_start(bool reboot)
+{
+	unsigned int timeout = READ_ONCE(shutdown_timeout_s);
+
+	if (timeout && atomic_cmpxchg(&shutdown_state, VMMCI_SHUTDOWN_IDLE,
+	    VMMCI_SHUTDOWN_PENDING) == VMMCI_SHUTDOWN_IDLE) {
+		shutdown_reboot = reboot;
+		shutdown_deadline_s = timeout;
+		log("forcing the %s in %u s if userspace hasn't finished\n",
+		    reboot ? "reboot" : "power off", timeout);
+
+		shutdown_sync();
+		queue_delayed_work(vmmci_wq, &shutdown_deadline_work,
+		    (unsigned long) timeout * HZ);
+	}
+
+	if (reboot) {
+		if (!READ_ONCE(kexec_reboot) || !kexec_reboot_start())
+			orderly_reboot();
+	} else {
+		orderly_poweroff(false);
+	}
+}
+
+/* Dispatches the commands the interrupt handler queued up */
+static void cmd_work_func(struct work_struct *work)
+{
+	struct virtio_vmmci *vmmci;
+	struct vmmci_cmd_entry entry;
+
+	vmmci = container_of(work, struct virtio_vmmci, cmd_work);
+
+	while (kfifo_out_spinlocked(&vmmci->cmd_queue, &entry, 1,
+	    &vmmci->cmd_lock)) {
+		switch (entry.cmd) {
+		case VMMCI_SHUTDOWN:
+			log("shutdown requested by host!\n");
+			shutdown_start(false);
+			break;
+
+		case VMMCI_REBOOT:
+			log("reboot requested by host!\n");
+			shutdown_start(true);
+			break;
+
+		case VMMCI_SYNCRTC:
+			log("clock sync requested by host\n");
+			vmmci_request_sync(vmmci);
+			break;
+
+		default:
+			printk(KERN_ERR "invalid command received: 0x%04x\n",
+			    entry.cmd);
+			vmmci_nl_error(vmmci, -EINVAL, entry.cmd);
+			break;
+		}
+
+		vmmci_nl_command(vmmci, entry.cmd, entry.acked);
+	}
+}
 
-#include "virtio_vmmci.h"
+/* Hands an ACKed command on to cmd_work */
+static void vmmci_queue_cmd(struct virtio_vmmci *vmmci, s32 cmd, bool acked)
+{
+	struct vmmci_cmd_entry entry = { .cmd = cmd, .acked = acked };
 
-/* You can either change the global debug level here by changing the
- * initialization value for "debug" or configure it at runtime via
- * the kernel module parameter. See README.md for details.
+	switch (cmd) {
+	case VMMCI_SHUTDOWN:
+		vmmci_count(vmmci, VMMCI_CNT_CMD_SHUTDOWN);
+		break;
+	case VMMCI_REBOOT:
+		vmmci_count(vmmci, VMMCI_CNT_CMD_REBOOT);
+		break;
+	case VMMCI_SYNCRTC:
+		vmmci_count(vmmci, VMMCI_CNT_CMD_SYNCRTC);
+		break;
+	default:
+		vmmci_count(vmmci, VMMCI_CNT_CMD_UNKNOWN);
+		break;
+	}
+
+	if (!kfifo_in_spinlocked(&vmmci->cmd_queue, &entry, 1, &vmmci->cmd_lock)) {
+		vmmci_count(vmmci, VMMCI_CNT_CMD_DROPPED);
+		printk(KERN_ERR "vmmci: command queue full, dropped command %d\n",
+		    cmd);
+		return;
+	}
+	queue_work(vmmci_wq, &vmmci->cmd_work);
+}
+
+/* Called from the interrupt. Only reads and ACKs the command, as the
+ * host is waiting on the ACK, and leaves the rest to cmd_work.
  */
-static int debug = 0;
+static void vmmci_changed(struct virtio_device *vdev)
+{
+	struct virtio_vmmci *vmmci = vdev->priv;
+	struct vmmci_cmd_entry entry = { 0 };
+	ktime_t start = ktime_get();
+	s64 latency;
 
-static int set_debug(const char *val, const struct kernel_param *kp)
+	vmmci_count(vmmci, VMMCI_CNT_CONFIG_IRQS);
+	vmmci_get(vmmci, VMMCI_CONFIG_COMMAND, &entry.cmd, sizeof(entry.cmd));
+
+	if (entry.cmd == VMMCI_NONE) {
+		debug("VMMCI_NONE received\n");
+		goto out;
+	}
+	vmmci_count(vmmci, VMMCI_CNT_CONFIG_IRQS_CMD);
+	trace_vmmci_command(vdev->index, entry.cmd);
+
+	if (virtio_has_feature(vdev, VMMCI_F_ACK)) {
+		vmmci_set(vmmci, VMMCI_CONFIG_COMMAND, &entry.cmd,
+		    sizeof(entry.cmd));
+		vmmci_count(vmmci, VMMCI_CNT_ACKS);
+		entry.acked = true;
+
+		latency = ktime_to_ns(ktime_sub(ktime_get(), start));
+		WRITE_ONCE(vmmci->ack_latency, latency);
+		if (latency > vmmci->ack_latency_max)
+			WRITE_ONCE(vmmci->ack_latency_max, latency);
+		trace_vmmci_ack(vdev->index, entry.cmd, latency);
+	}
+
+	vmmci_queue_cmd(vmmci, entry.cmd, entry.acked);
+out:
+	vmmci_hist_since(vmmci, VMMCI_HIST_IRQ, start);
+}
+
+static int vmmci_event_add(struct virtio_vmmci *vmmci,
+			   struct vmmci_eventq_buf *ev, gfp_t gfp)
 {
-	int n = 0, rc;
-	rc = kstrtoint(val, 10, &n);
-	if (rc || n < 0)
-		return -EINVAL;
+	struct scatterlist sg;
 
-	return param_set_int(val, kp);
+	sg_init_one(&sg, ev, sizeof(*ev));
+	return virtqueue_add_inbuf(vmmci->event_vq, &sg, 1, ev, gfp);
 }
 
-static int get_debug(char *buffer, const struct kernel_param *kp)
+/* The event queue's callback, also from the interrupt. Takes every
+ * command the host queued and gives the buffers straight back.
+ */
+static void vmmci_event_done(struct virtqueue *vq)
 {
-	int bytes;
-	bytes = snprintf(buffer, 1024, "%d\n", debug);
-	return bytes + 1; // account for NULL
+	struct virtio_vmmci *vmmci = vq->vdev->priv;
+	struct vmmci_eventq_buf *ev;
+	ktime_t start = ktime_get();
+	unsigned int len;
+	s32 cmd;
+
+	vmmci_count(vmmci, VMMCI_CNT_EVENTQ_IRQS);
+	while ((ev = virtqueue_get_buf(vq, &len)) != NULL) {
+		if (len >= sizeof(ev->cmd)) {
+			cmd = le32_to_cpu(ev->cmd);
+			trace_vmmci_command(vq->vdev->index, cmd);
+			if (cmd != VMMCI_NONE)
+				vmmci_queue_cmd(vmmci, cmd, true);
+		}
+		vmmci_event_add(vmmci, ev, GFP_ATOMIC);
+	}
+	virtqueue_kick(vq);
+
+	vmmci_hist_since(vmmci, VMMCI_HIST_IRQ, start);
 }
 
-static const struct kernel_param_ops debug_param_ops = {
-	.set	= set_debug,
-	.get	= get_debug,
-};
+/* Sets up the event queue if the host has one. It's optional: without
+ * it, commands still come through the register.
+ */
+static void vmmci_event_register(struct virtio_vmmci *vmmci)
+{
+	struct virtio_device *vdev = vmmci->vdev;
+	struct virtqueue *vq;
+	int i, rc;
+
+	vq = virtio_find_single_vq(vdev, vmmci_event_done, "events");
+	if (IS_ERR(vq)) {
+		printk(KERN_WARNING "vmmci: no event queue (%ld), using the command register\n",
+		    PTR_ERR(vq));
+		return;
+	}
+	vmmci->event_vq = vq;
+
+	for (i = 0; i < VMMCI_EVENTQ_BUFS; i++) {
+		rc = vmmci_event_add(vmmci, &vmmci->events[i], GFP_KERNEL);
+		if (rc) {
+			printk(KERN_WARNING "vmmci: only %d event buffers (%d)\n",
+			    i, rc);
+			break;
+		}
+	}
 
-module_param_cb(debug, &debug_param_ops, &debug, 0664);
+	// buffers may only be kicked to the host once we're DRIVER_OK
+	virtio_device_ready(vdev);
+	virtqueue_kick(vq);
+}
 
-/* Define our sysctl table entries for exposing our current clock
- * drift in seconds and nanoseconds. (Avoid using floating point vals
- * for now.)
+/* Only once the device is reset, so the callback can't run any more */
+static void vmmci_event_unregister(struct virtio_vmmci *vmmci)
+{
+	if (!vmmci->event_vq)
+		return;
+
+	vmmci->vdev->config->del_vqs(vmmci->vdev);
+	vmmci->event_vq = NULL;
+}
+
+/* debugfs: one file per latency histogram under
+ * /sys/kernel/debug/vmmci/<device>/latency/. Writing anything to a file
+ * resets it.
  */
-int drift_sec = 0;
-int drift_nsec = 0;
+static struct dentry *vmmci_debugfs_root;
 
-static struct ctl_table_header *vmmci_table_header;
+static int vmmci_hist_show(struct seq_file *m, void *v)
+{
+	struct vmmci_hist *h = m->private;
+	unsigned long long lo;
+	long long n;
+	int b;
+
+	seq_printf(m, "count %lld sum_ns %lld max_ns %lld\n",
+	    (long long) atomic64_read(&h->count),
+	    (long long) atomic64_read(&h->sum),
+	    (long long) atomic64_read(&h->max));
+
+	for (b = 0; b < VMMCI_HIST_BUCKETS; b++) {
+		n = atomic64_read(&h->buckets[b]);
+		if (!n)
+			continue;
+
+		lo = b ? 1ULL << b : 0;
+		if (b == VMMCI_HIST_BUCKETS - 1)
+			seq_printf(m, "[%llu, inf) %lld\n", lo, n);
+		else
+			seq_printf(m, "[%llu, %llu) %lld\n", lo, 1ULL << (b + 1), n);
+	}
 
-static struct ctl_table drift_table[] = {
-	{
-		.procname	= "drift_sec",
-		.mode		= 0444,
-		.maxlen		= sizeof(int),
-		.data		= &drift_sec,
-		.proc_handler	= &proc_dointvec,
-	},
-	{
-		.procname	= "drift_nsec",
-		.mode		= 0444,
-		.maxlen		= sizeof(int),
-		.data		= &drift_nsec,
-		.proc_handler	= &proc_dointvec,
-	},
-	{ },
-};
+	return 0;
+}
 
-static struct ctl_table vmmci_table = {
-	.procname	= "vmmci",
-	.child		= drift_table,
+static int vmmci_hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, vmmci_hist_show, inode->i_private);
+}
+
+static ssize_t vmmci_hist_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct vmmci_hist *h = ((struct seq_file *) file->private_data)->private;
+	int b;
+
+	atomic64_set(&h->count, 0);
+	atomic64_set(&h->sum, 0);
+	atomic64_set(&h->max, 0);
+	for (b = 0; b < VMMCI_HIST_BUCKETS; b++)
+		atomic64_set(&h->buckets[b], 0);
+
+	return count;
+}
+
+static const struct file_operations vmmci_hist_fops = {
+	.owner		= THIS_MODULE,
+	.open		= vmmci_hist_open,
+	.read		= seq_read,
+	.write		= vmmci_hist_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
 };
 
-/* Define our basic commands and structs for our device including the
- * virtio feature tables.
+/* Copies out whole records from the cursor on, skipping ahead to the
+ * oldest one still in the ring. A slot whose seq changes while we copy
+ * it was overwritten under us and is skipped as well.
  */
-enum vmmci_cmd {
-	VMMCI_NONE = 0,
-	VMMCI_SHUTDOWN,
-	VMMCI_REBOOT,
-	VMMCI_SYNCRTC,
-};
+static ssize_t drift_history_read(struct file *file, char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	struct virtio_vmmci *vmmci = file->private_data;
+	struct vmmci_drift_record *slot, rec;
+	unsigned long head, n;
+	size_t copied = 0;
+	u64 seq;
 
-struct virtio_vmmci {
-	struct virtio_device *vdev;
+	if (count < sizeof(rec))
+		return -EINVAL;
 
-	/* Used for monitoring clock drift. Needs scheduling. */
-	struct workqueue_struct *monitor_wq;
-	struct delayed_work monitor_work;
+	head = smp_load_acquire(&vmmci->drift_head);
+	n = div_u64(*ppos, sizeof(rec));
+	if (head > VMMCI_DRIFT_RING_LEN && n < head - VMMCI_DRIFT_RING_LEN)
+		n = head - VMMCI_DRIFT_RING_LEN;
+
+	for (; n < head && copied + sizeof(rec) <= count; n++) {
+		slot = &vmmci->drift_ring[n % VMMCI_DRIFT_RING_LEN];
+
+		seq = READ_ONCE(slot->seq);
+		smp_rmb();
+		rec = *slot;
+		smp_rmb();
+		if (seq != n + 1 || READ_ONCE(slot->seq) != seq)
+			continue;
+
+		rec.seq = seq;
+		if (copy_to_user(buf + copied, &rec, sizeof(rec))) {
+			if (!copied)
+				return -EFAULT;
+			break;
+		}
+		copied += sizeof(rec);
+	}
 
-	/* Used for synchronizing clock. Work is put on from
-	 * the general purpose queue from the interrupt handler.
-	 */
-	struct work_struct sync_work;
-};
+	*ppos = (loff_t) n * sizeof(rec);
+	return copied;
+}
 
-static struct virtio_device_id id_table[] = {
-	{ VIRTIO_ID_VMMCI, VIRTIO_DEV_ANY_ID },
-	{ 0 },
+static const struct file_operations drift_history_fops = {
+	.owner		= THIS_MODULE,
+	.open		= simple_open,
+	.read		= drift_history_read,
+	.llseek		= default_llseek,
 };
 
-static unsigned int features[] = {
-	VMMCI_F_TIMESYNC, VMMCI_F_ACK, VMMCI_F_SYNCRTC,
-};
+static void vmmci_debugfs_register(struct virtio_vmmci *vmmci)
+{
+	struct dentry *dir;
+	int i;
 
+	if (IS_ERR_OR_NULL(vmmci_debugfs_root))
+		return;
 
-/* Synchronizes the system time to the hardware clock (rtc). Uses a process
- * similar to the one performed by the kernel at startup as defined in
- * the Linux kernel source file /drivers/rtc/hctosys.c. Minus the 32-bit
- * and non-amd64 specific stuff.
- */
-static int sync_system_time(void)
+	vmmci->debugfs = debugfs_create_dir(dev_name(&vmmci->vdev->dev),
+	    vmmci_debugfs_root);
+	if (IS_ERR_OR_NULL(vmmci->debugfs))
+		return;
+
+	debugfs_create_file("drift_history", 0400, vmmci->debugfs, vmmci,
+	    &drift_history_fops);
+
+	dir = debugfs_create_dir("latency", vmmci->debugfs);
+	if (IS_ERR_OR_NULL(dir))
+		return;
+
+	for (i = 0; i < VMMCI_HIST_MAX; i++)
+		debugfs_create_file(vmmci_hist_names[i], 0600, dir,
+		    &vmmci->hist[i], &vmmci_hist_fops);
+}
+
+static void vmmci_debugfs_unregister(struct virtio_vmmci *vmmci)
 {
-	int rc = -1;
-	struct rtc_time hw_tm;
-	struct timespec64 time = {
-		.tv_nsec = NSEC_PER_SEC >> 1,
-	};
+	debugfs_remove_recursive(vmmci->debugfs);
+	vmmci->debugfs = NULL;
+}
 
-	// Try to open the hardware clock...which should be the emulated
-	// mc146818 clock device.
-	struct rtc_device *rtc = rtc_class_open(CONFIG_RTC_HCTOSYS_DEVICE);
-	if (rtc == NULL) {
-		printk(KERN_ERR "vmmci unable to open rtc device\n");
-		rc = -ENODEV;
-		goto end;
-	}
+/* Per-device sysfs attributes, found under the virtio device */
+static ssize_t correct_mode_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct virtio_vmmci *vmmci = dev_to_virtio(dev)->priv;
 
-	// Reading the rtc device should be the same as getting the host
-	// time via the vmmci config registers...just without all the
-	// nastiness
-	rc = rtc_read_time(rtc, &hw_tm);
-	if (rc) {
-		printk(KERN_ERR "vmmci failed to read the hardware clock\n");
-		goto close;
-	}
-	time.tv_sec = rtc_tm_to_time64(&hw_tm);
+	return sprintf(buf, "%s\n", correct_mode_names[vmmci->correct_mode]);
+}
 
-	// Setting the system clock using do_settimeofday64 should be safe
-	// as it is similar to OpenBSD's tc_setclock that steps the system
-	// clock while triggering any alarms/timeouts that should fire
-	rc = do_settimeofday64(&time);
-	if (rc) {
-		printk(KERN_ERR "vmmci failed to set system clock to rtc!\n");
-		goto close;
-	}
-	log("set system clock to %d-%02d-%02d %02d:%02d:%02d UTC\n",
-	    hw_tm.tm_year + 1900, hw_tm.tm_mon + 1, hw_tm.tm_mday,
-	    hw_tm.tm_hour, hw_tm.tm_min, hw_tm.tm_sec);
+static ssize_t correct_mode_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct virtio_vmmci *vmmci = dev_to_virtio(dev)->priv;
+	int n;
 
-close:
-	// I assume this cleans up any references, if the kernel tracks them
-	rtc_class_close(rtc);
+	n = match_name(correct_mode_names, ARRAY_SIZE(correct_mode_names), buf);
+	if (n < 0)
+		return n;
+	if (n == VMMCI_CORRECT_SLEW && !resolve_adjtimex())
+		return -EOPNOTSUPP;
 
-end:
-	return rc;
+	vmmci->correct_mode = n;
+	return count;
 }
+static DEVICE_ATTR_RW(correct_mode);
 
-static void sync_work_func(struct work_struct *work)
+static ssize_t step_threshold_us_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
 {
-	int rc = 0;
+	struct virtio_vmmci *vmmci = dev_to_virtio(dev)->priv;
 
-	debug("starting clock synchronization...");
-	rc = sync_system_time();
+	return sprintf(buf, "%u\n", vmmci->step_threshold_us);
+}
+
+static ssize_t step_threshold_us_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	struct virtio_vmmci *vmmci = dev_to_virtio(dev)->priv;
+	unsigned int n;
+	int rc;
+
+	rc = kstrtouint(buf, 10, &n);
 	if (rc)
-		debug("clock synchronization failed (%d)\n", rc);
-	else
-		debug("finished clock synchronization!\n");
+		return rc;
 
+	vmmci->step_threshold_us = n;
+	return count;
 }
+static DEVICE_ATTR_RW(step_threshold_us);
 
-/* Runs our guest/host clock drift measurements and logs them to the syslog */
-static void monitor_work_func(struct work_struct *work)
+/* The whole latest measurement, "offset_ns delay_ns time_ns samples" */
+static ssize_t drift_show(struct device *dev, struct device_attribute *attr,
+			  char *buf)
 {
-	struct virtio_vmmci *vmmci;
-	struct timespec64 host, guest, diff;
-	s64 sec, usec; // should these be signed or unsigned?
+	struct virtio_vmmci *vmmci = dev_to_virtio(dev)->priv;
+	struct vmmci_drift_state st;
+	int len;
+
+	drift_state_read(&vmmci->drift_lock, &vmmci->drift, &st);
+	len = drift_state_format(&st, buf, PAGE_SIZE - 1);
+	buf[len++] = '\n';
+	return len;
+}
 
-	debug("measuring clock drift...\n");
+static DEVICE_ATTR_RO(drift);
 
-	// My god this container_of stuff seems...messy? Oh, Linux...
-	vmmci = container_of((struct delayed_work *) work, struct virtio_vmmci, monitor_work);
+/* All the event counters as "name value" lines, in one read */
+static ssize_t stats_show(struct device *dev, struct device_attribute *attr,
+			  char *buf)
+{
+	struct virtio_vmmci *vmmci = dev_to_virtio(dev)->priv;
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < VMMCI_CNT_MAX; i++)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s %lu\n",
+		    vmmci_counter_names[i], vmmci_counter_sum(vmmci, i));
+	return len;
+}
 
-	vmmci->vdev->config->get(vmmci->vdev, VMMCI_CONFIG_TIME_SEC, &sec, sizeof(sec));
-	vmmci->vdev->config->get(vmmci->vdev, VMMCI_CONFIG_TIME_USEC, &usec, sizeof(usec));
-	getnstimeofday64(&guest);
+static DEVICE_ATTR_RO(stats);
 
-	debug("host clock: %lld.%lld, guest clock: " TIME_FMT,
-	    sec, usec * NSEC_PER_USEC, guest.tv_sec, guest.tv_nsec);
+struct vmmci_stat_attr {
+	struct device_attribute attr;
+	enum vmmci_stat stat;
+};
 
-	host.tv_sec = sec;
-	host.tv_nsec = (long) usec * NSEC_PER_USEC;
+static ssize_t stat_show(struct device *dev, struct device_attribute *attr,
+			 char *buf)
+{
+	struct virtio_vmmci *vmmci = dev_to_virtio(dev)->priv;
+	struct vmmci_stat_attr *sa = container_of(attr, struct vmmci_stat_attr,
+	    attr);
 
-	diff = timespec64_sub(host, guest);
+	return sprintf(buf, "%lld\n", vmmci_stat(vmmci, sa->stat));
+}
 
-	// XXX: our globals for tracking drift...since we're not SMP enabled let's
-	// ignore locking/unlocking for now...also yes, we're blindly going from a
-	// s64 to an int here.
-	drift_sec = diff.tv_sec;
-	drift_nsec = diff.tv_nsec;
+#define VMMCI_STAT_ATTR(_name, _stat)					\
+	static struct vmmci_stat_attr stat_attr_##_name = {		\
+		.attr = __ATTR(_name, 0444, stat_show, NULL),		\
+		.stat = _stat,						\
+	}
 
-	debug("current clock drift: " TIME_FMT " seconds\n", diff.tv_sec, diff.tv_nsec);
+VMMCI_STAT_ATTR(drift_sec, VMMCI_STAT_DRIFT_SEC);
+VMMCI_STAT_ATTR(drift_nsec, VMMCI_STAT_DRIFT_NSEC);
+VMMCI_STAT_ATTR(delay_nsec, VMMCI_STAT_DELAY);
+VMMCI_STAT_ATTR(ack_latency_nsec, VMMCI_STAT_ACK_LATENCY);
+VMMCI_STAT_ATTR(ack_latency_max_nsec, VMMCI_STAT_ACK_LATENCY_MAX);
+VMMCI_STAT_ATTR(freq_ppb, VMMCI_STAT_FREQ_PPB);
+VMMCI_STAT_ATTR(tsc_skew_ppb, VMMCI_STAT_TSC_SKEW_PPB);
+VMMCI_STAT_ATTR(time_retries, VMMCI_STAT_TIME_RETRIES);
+VMMCI_STAT_ATTR(sync_requests, VMMCI_STAT_SYNC_REQUESTS);
+VMMCI_STAT_ATTR(sync_coalesced, VMMCI_STAT_SYNC_COALESCED);
+VMMCI_STAT_ATTR(sync_runs, VMMCI_STAT_SYNC_RUNS);
+VMMCI_STAT_ATTR(auto_slews, VMMCI_STAT_AUTO_SLEWS);
+VMMCI_STAT_ATTR(auto_steps, VMMCI_STAT_AUTO_STEPS);
+VMMCI_STAT_ATTR(auto_alerts, VMMCI_STAT_AUTO_ALERTS);
+
+static struct attribute *vmmci_attrs[] = {
+	&dev_attr_drift.attr,
+	&dev_attr_stats.attr,
+	&stat_attr_drift_sec.attr.attr,
+	&stat_attr_drift_nsec.attr.attr,
+	&stat_attr_delay_nsec.attr.attr,
+	&stat_attr_ack_latency_nsec.attr.attr,
+	&stat_attr_ack_latency_max_nsec.attr.attr,
+	&stat_attr_freq_ppb.attr.attr,
+	&stat_attr_tsc_skew_ppb.attr.attr,
+	&stat_attr_time_retries.attr.attr,
+	&stat_attr_sync_requests.attr.attr,
+	&stat_attr_sync_coalesced.attr.attr,
+	&stat_attr_sync_runs.attr.attr,
+	&stat_attr_auto_slews.attr.attr,
+	&stat_attr_auto_steps.attr.attr,
+	&stat_attr_auto_alerts.attr.attr,
+	&dev_attr_correct_mode.attr,
+	&dev_attr_step_threshold_us.attr,
+	NULL,
+};
 
-	queue_delayed_work(vmmci->monitor_wq, &vmmci->monitor_work, DELAY_20s);
-	debug("drift measurement routine finished\n");
-}
+static const struct attribute_group vmmci_attr_group = {
+	.attrs = vmmci_attrs,
+};
 
 static int vmmci_probe(struct virtio_device *vdev)
 {
@@ -238,7 +2776,22 @@ static int vmmci_probe(struct virtio_device *vdev)
 		printk(KERN_ERR "vmmci_probe: failed to alloc vmmci struct\n");
 		return -ENOMEM;
 	}
+	vmmci->counters = alloc_percpu(struct vmmci_counters);
+	if (!vmmci->counters) {
+		printk(KERN_ERR "vmmci_probe: failed to alloc counters\n");
+		kfree(vmmci);
+		vdev->priv = NULL;
+		return -ENOMEM;
+	}
 	vmmci->vdev = vdev;
+	INIT_WORK(&vmmci->cmd_work, cmd_work_func);
+	INIT_KFIFO(vmmci->cmd_queue);
+	spin_lock_init(&vmmci->cmd_lock);
+	seqlock_init(&vmmci->drift_lock);
+	mutex_init(&vmmci->report_lock);
+	mutex_init(&vmmci->correct_lock);
+	vmmci->correct_mode = correct_mode;
+	vmmci->step_threshold_us = step_threshold_us;
 
 	if (virtio_has_feature(vdev, VMMCI_F_TIMESYNC))
 		debug("...found feature TIMESYNC\n");
@@ -246,84 +2799,99 @@ static int vmmci_probe(struct virtio_device *vdev)
 		debug("...found feature ACK\n");
 	if (virtio_has_feature(vdev, VMMCI_F_SYNCRTC))
 		debug("...found feature SYNCRTC\n");
+	if (virtio_has_feature(vdev, VMMCI_F_EVENTQ))
+		debug("...found feature EVENTQ\n");
+	if (virtio_has_feature(vdev, VMMCI_F_REPORT))
+		debug("...found feature REPORT\n");
+
+	// wire up routine clock drift monitoring. The work is deferrable
+	// so an idle tickless cpu isn't woken up just to take a sample.
+	vmmci->monitor_interval = monitor_min_interval();
+	INIT_DEFERRABLE_WORK(&vmmci->monitor_work, monitor_work_func);
+	INIT_DELAYED_WORK(&vmmci->sync_work, sync_work_func);
+
+	// wait for the initial sync, so whatever runs after us (the rest
+	// of the initramfs, say) already sees host time
+	if (initial_sync && virtio_has_feature(vdev, VMMCI_F_TIMESYNC)) {
+		vmmci_sync_now(vmmci);
+	}
 
-	// wire up routine clock drift monitoring
-	vmmci->monitor_wq = create_singlethread_workqueue(QNAME_MONITOR);
-	if (vmmci->monitor_wq == NULL) {
-		printk(KERN_ERR "vmmci_probe: failed to alloc monitoring workqueue\n");
-		return -ENOMEM;
+	// the sync re-arms the monitor, but the first sample needn't wait
+	if (monitor) {
+		mutex_lock(&vmmci->correct_lock);
+		monitor_queue(vmmci, 0);
+		mutex_unlock(&vmmci->correct_lock);
 	}
 
-	INIT_DELAYED_WORK(&vmmci->monitor_work, monitor_work_func);
-	queue_delayed_work(vmmci->monitor_wq, &vmmci->monitor_work, DELAY_1s);
+	if (sysfs_create_group(&vdev->dev.kobj, &vmmci_attr_group))
+		printk(KERN_WARNING "vmmci_probe: failed to create sysfs attributes\n");
 
-	INIT_WORK(&vmmci->sync_work, sync_work_func);
+	if (ptp && virtio_has_feature(vdev, VMMCI_F_TIMESYNC))
+		vmmci_ptp_register(vmmci);
+	if (watchdog && virtio_has_feature(vdev, VMMCI_F_TIMESYNC))
+		vmmci_clocksource_register(vmmci);
+	if (virtio_has_feature(vdev, VMMCI_F_TIMESYNC))
+		vmmci_time_page_register(vmmci);
+	vmmci_debugfs_register(vmmci);
+	if (virtio_has_feature(vdev, VMMCI_F_EVENTQ))
+		vmmci_event_register(vmmci);
 
-	vmmci_table_header = register_sysctl_table(&vmmci_table);
+	mutex_lock(&vmmci_devices_lock);
+	list_add_tail(&vmmci->node, &vmmci_devices);
+	mutex_unlock(&vmmci_devices_lock);
 
 	log("started VMM Control Interface driver\n");
 	return 0;
 }
 
-static void vmmci_remove(struct virtio_device *vdev)
+/* Cancels all of a device's work for good (until restore). Commands
+ * request syncs, the sync re-arms the monitor and the monitor can request
+ * a sync, so once stopping is set neither gets queued again, and the sync
+ * is cancelled once more after the monitor in case the monitor queued it
+ * while the first cancel was waiting.
+ */
+static void vmmci_stop_work(struct virtio_vmmci *vmmci)
 {
-	struct virtio_vmmci *vmmci = vdev->priv;
-	debug("removing device\n");
-
-	cancel_delayed_work(&vmmci->monitor_work);
-	flush_workqueue(vmmci->monitor_wq);
-	destroy_workqueue(vmmci->monitor_wq);
-	cancel_work_sync(&vmmci->sync_work);
-	debug("cancelled, flushed, and destroyed work queues\n");
-
-	vdev->config->reset(vdev);
-        debug("reset device\n");
-
-	kfree(vmmci);
-
-	unregister_sysctl_table(vmmci_table_header);
+	WRITE_ONCE(vmmci->stopping, true);
 
-	log("removed device\n");
+	cancel_work_sync(&vmmci->cmd_work);
+	cancel_delayed_work_sync(&vmmci->sync_work);
+	cancel_delayed_work_sync(&vmmci->monitor_work);
+	cancel_delayed_work_sync(&vmmci->sync_work);
 }
 
-static void vmmci_changed(struct virtio_device *vdev)
+static void vmmci_remove(struct virtio_device *vdev)
 {
 	struct virtio_vmmci *vmmci = vdev->priv;
-	s32 cmd = 0;
-	debug("reading command register...\n");
+	debug("removing device\n");
 
-	vdev->config->get(vdev, VMMCI_CONFIG_COMMAND, &cmd, sizeof(cmd));
+	mutex_lock(&vmmci_devices_lock);
+	list_del(&vmmci->node);
+	mutex_unlock(&vmmci_devices_lock);
 
-	switch (cmd) {
-	case VMMCI_NONE:
-		debug("VMMCI_NONE received\n");
-		break;
+	vmmci_clocksource_unregister(vmmci);
+	vmmci_ptp_unregister(vmmci);
+	sysfs_remove_group(&vdev->dev.kobj, &vmmci_attr_group);
 
-	case VMMCI_SHUTDOWN:
-		log("shutdown requested by host!\n");
-		orderly_poweroff(false);
-		break;
+	// the interrupt and event queue callbacks queue cmd_work, so
+	// silence the device before cancelling it
+	vdev->config->reset(vdev);
+	debug("reset device\n");
 
-	case VMMCI_REBOOT:
-		log("reboot requested by host!\n");
-		orderly_reboot();
-		break;
+	vmmci_stop_work(vmmci);
+	debug("cancelled and flushed work\n");
 
-	case VMMCI_SYNCRTC:
-		log("clock sync requested by host\n");
-		schedule_work(&vmmci->sync_work);
-		break;
+	vmmci_event_unregister(vmmci);
+	vmmci_time_page_unregister(vmmci);
+	vmmci_debugfs_unregister(vmmci);
 
-	default:
-		printk(KERN_ERR "invalid command received: 0x%04x\n", cmd);
-		break;
-	}
+	if (vmmci->rtc)
+		rtc_class_close(vmmci->rtc);
 
-	if (cmd != VMMCI_NONE
-	    && (vdev->features & VMMCI_F_ACK)) {
-		vdev->config->set(vdev, VMMCI_CONFIG_COMMAND, &cmd, sizeof(cmd));
-		debug("...acknowledged command %d\n", cmd);
-	}
+	free_percpu(vmmci->counters);
+	kfree(vmmci);
+
+	log("removed device\n");
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
@@ -335,15 +2903,50 @@ static int vmmci_validate(struct virtio_device *vdev)
 #endif
 
 #ifdef CONFIG_PM_SLEEP
+/* Quiesces the work so none of it runs against a device that's going
+ * away underneath us.
+ */
 static int vmmci_freeze(struct virtio_device *vdev)
 {
-	debug("not implemented\n");
+	struct virtio_vmmci *vmmci = vdev->priv;
+
+	// restore resets the device anyway, and the event queue won't
+	// survive it, so drop it here and set it up again there
+	vdev->config->reset(vdev);
+
+	vmmci_stop_work(vmmci);
+	vmmci_event_unregister(vmmci);
+	debug("quiesced work for suspend\n");
+
 	return 0;
 }
 
+/* The kernel restores the clock from the rtc on resume, so it's only as
+ * good as a second. Sync to the host right away and start the drift
+ * monitor over, since the samples from before the suspend are stale.
+ */
 static int vmmci_restore(struct virtio_device *vdev)
 {
-	debug("not implemented\n");
+	struct virtio_vmmci *vmmci = vdev->priv;
+
+	vmmci->monitor_has_prev = false;
+	vmmci->monitor_interval = monitor_min_interval();
+	vmmci->freq_count = 0;
+	vmmci->tsc_prev = 0;
+	WRITE_ONCE(vmmci->stopping, false);
+
+	if (virtio_has_feature(vdev, VMMCI_F_EVENTQ))
+		vmmci_event_register(vmmci);
+
+	if (monitor) {
+		mutex_lock(&vmmci->correct_lock);
+		monitor_queue(vmmci, 0);
+		mutex_unlock(&vmmci->correct_lock);
+	}
+	if (virtio_has_feature(vdev, VMMCI_F_TIMESYNC))
+		vmmci_request_sync(vmmci);
+
+	debug("re-armed work after resume\n");
 	return 0;
 }
 #endif
@@ -366,7 +2969,103 @@ static struct virtio_driver virtio_vmmci_driver = {
 #endif
 };
 
-module_virtio_driver(virtio_vmmci_driver);
+#ifndef MODULE
+/* Built in, the driver stays at device_initcall (module_init) rather
+ * than registering any earlier: the device only shows up once the
+ * virtio_pci_obsd transport, itself a device_initcall, has probed, so an
+ * earlier initcall wouldn't get the probe or its initial sync in any
+ * sooner. That sync can't be the last word either, since rtc_hctosys()
+ * runs as a late_initcall and sets the clock back to the rtc's whole
+ * seconds. So sync again from late_initcall_sync, after it, which still
+ * happens before userspace starts.
+ */
+static int vmmci_late_sync_one(struct device *dev, void *data)
+{
+	struct virtio_vmmci *vmmci = dev_to_virtio(dev)->priv;
+
+	if (vmmci && virtio_has_feature(vmmci->vdev, VMMCI_F_TIMESYNC)) {
+		vmmci_sync_now(vmmci);
+	}
+	return 0;
+}
+
+static int __init vmmci_late_sync(void)
+{
+	if (initial_sync)
+		driver_for_each_device(&virtio_vmmci_driver.driver, NULL, NULL,
+		    vmmci_late_sync_one);
+	return 0;
+}
+late_initcall_sync(vmmci_late_sync);
+#endif
+
+static int __init vmmci_init(void)
+{
+	int rc;
+
+	rc = vmmci_nl_register();
+	if (rc) {
+		printk(KERN_ERR "vmmci: failed to register netlink family (%d)\n", rc);
+		return rc;
+	}
+
+	// freezable, so nothing runs while the guest suspends
+	vmmci_wq = alloc_workqueue("%s", WQ_UNBOUND | WQ_SYSFS | WQ_FREEZABLE
+	    | (wq_highpri ? WQ_HIGHPRI : 0), 0, QNAME_WORK);
+	if (!vmmci_wq) {
+		printk(KERN_ERR "vmmci: failed to alloc workqueue\n");
+		rc = -ENOMEM;
+		goto err_wq;
+	}
+
+	// debugfs and the sysctls are best effort, the driver works fine
+	// without them
+	vmmci_debugfs_root = debugfs_create_dir("vmmci", NULL);
+	vmmci_table_header = register_sysctl_table(&vmmci_table);
+	if (!vmmci_table_header)
+		printk(KERN_WARNING "vmmci: failed to register sysctls\n");
+
+	rc = register_reboot_notifier(&vmmci_reboot_nb);
+	if (rc)
+		goto err_notifier;
+
+	rc = register_virtio_driver(&virtio_vmmci_driver);
+	if (rc)
+		goto err_register;
+
+	return 0;
+
+err_register:
+	unregister_reboot_notifier(&vmmci_reboot_nb);
+err_notifier:
+	if (vmmci_table_header)
+		unregister_sysctl_table(vmmci_table_header);
+	debugfs_remove_recursive(vmmci_debugfs_root);
+	destroy_workqueue(vmmci_wq);
+err_wq:
+	genl_unregister_family(&vmmci_nl_family);
+	return rc;
+}
+
+static void __exit vmmci_exit(void)
+{
+	unregister_virtio_driver(&virtio_vmmci_driver);
+	unregister_reboot_notifier(&vmmci_reboot_nb);
+	cancel_delayed_work_sync(&shutdown_deadline_work);
+	if (vmmci_table_header)
+		unregister_sysctl_table(vmmci_table_header);
+	debugfs_remove_recursive(vmmci_debugfs_root);
+	destroy_workqueue(vmmci_wq);
+	genl_unregister_family(&vmmci_nl_family);
+}
+
+module_init(vmmci_init);
+module_exit(vmmci_exit);
+
+#ifdef CONFIG_VIRTIO_VMMCI_KUNIT_TEST
+#include "virtio_vmmci_test.c"
+#endif
+
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("OpenBSD VMM Control Interface");
 MODULE_AUTHOR("Dave Voutila <voutilad@gmail.com>");
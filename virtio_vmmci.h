@@ -18,18 +18,13 @@
  *  along with this program; if not, write to the Free Software
  *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
+#include <linux/jump_label.h>
+#include <linux/types.h>
 #include <linux/version.h>
 #ifndef _VIRTIO_VMMCI_H
 #define _VIRTIO_VMMCI_H
 
-const char *QNAME_MONITOR = "vmmci-monitor";
-// const char *QNAME_SYNC = "vmmci-sync";
-
-/* These might need tweaking. HZ on Linux is 250 now...so not sure
- * exactly how to get to the right representation of seconds...
- */
-const int DELAY_20s = HZ * 4;
-const int DELAY_1s = HZ / 5;
+#define QNAME_WORK			"vmmci"
 
 #define VIRTIO_ID_VMMCI			0xffff	/* matches OpenBSD's private id */
 
@@ -41,10 +36,54 @@ const int DELAY_1s = HZ / 5;
 #define VMMCI_CONFIG_TIME_SEC	4
 #define VMMCI_CONFIG_TIME_USEC	12
 
+/*
+ * With VMMCI_F_REPORT, the guest publishes its view of the clocks in the
+ * registers after the host time, for vmd to read. The sequence number is
+ * odd while the guest is writing, so the host reads it before and after
+ * the rest and retries if it was odd or changed. The times are in ns.
+ */
+#define VMMCI_CONFIG_REPORT_SEQ		20	/* __le32 */
+#define VMMCI_CONFIG_REPORT_STATUS	24	/* __le32, VMMCI_REPORT_* */
+#define VMMCI_CONFIG_REPORT_OFFSET	28	/* __le64, host - guest */
+#define VMMCI_CONFIG_REPORT_DELAY	36	/* __le64, round-trip of the reading */
+#define VMMCI_CONFIG_REPORT_SYNC	44	/* __le64, guest time of the last sync */
+
+#define VMMCI_REPORT_VALID		(1 << 0)	/* offset and delay hold a sample */
+#define VMMCI_REPORT_SYNCED		(1 << 1)	/* a clock sync has succeeded */
+#define VMMCI_REPORT_SYNC_FAILED	(1 << 2)	/* the last one didn't */
+
+/*
+ * A consistent snapshot of the host clock. Reading VMMCI_CONFIG_TIME_SEC
+ * with a length of sizeof(struct vmmci_time_snapshot) makes the transport
+ * fetch both the seconds and microseconds registers with as few accesses
+ * as it can, retrying if the seconds rolled over in between.
+ */
+struct vmmci_time_snapshot {
+	s64 sec;
+	s64 usec;
+	u32 retries;	/* torn reads the transport had to retry */
+	u32 reads;	/* config register accesses it took */
+};
+
 /* Features...these get bit-shifted in the Linux virtio code */
 #define VMMCI_F_TIMESYNC		0
 #define VMMCI_F_ACK			1
 #define VMMCI_F_SYNCRTC			2
+#define VMMCI_F_EVENTQ			3
+#define VMMCI_F_REPORT			4
+
+/*
+ * With VMMCI_F_EVENTQ, virtqueue 0 carries host commands as well as the
+ * command register. The guest keeps it stocked with buffers the size of
+ * a struct vmmci_eventq_buf, and the host fills one per command, so a
+ * batch of commands costs one interrupt and no register round-trips.
+ * Handing the buffer back used is the ACK. (Not struct vmmci_event, that
+ * name is taken by the netlink events in virtio_vmmci_uapi.h.)
+ */
+struct vmmci_eventq_buf {
+	__le32 cmd;
+	__le32 reserved;
+};
 
 /*
  * Linux is in a 32/64 bit transition phases where v4.17 and below
@@ -57,9 +96,26 @@ const int DELAY_1s = HZ / 5;
 #define TIME_FMT "%lld.%ld"
 #endif
 
+/*
+ * debug() sits on hot paths like the interrupt handler, so it's gated on a
+ * static key the driver flips along with its debug parameter rather than
+ * on a load and branch of the parameter itself.
+ */
+DECLARE_STATIC_KEY_FALSE(vmmci_debug_key);
 #define debug(fmt, ...) \
-	do { if (debug) pr_info("vmmci: [%s] " fmt, __func__, ##__VA_ARGS__); \
+	do { if (static_branch_unlikely(&vmmci_debug_key)) \
+		pr_info("vmmci: [%s] " fmt, __func__, ##__VA_ARGS__); \
 	} while (0)
 #define log(fmt, ...) pr_info("vmmci: " fmt, ##__VA_ARGS__)
 
+/*
+ * The KUnit suites swap out the few functions that touch the device
+ * registers or the system clock. Without them this costs nothing.
+ */
+#ifdef CONFIG_VIRTIO_VMMCI_KUNIT_TEST
+#include <kunit/static_stub.h>
+#elif !defined(KUNIT_STATIC_STUB_REDIRECT)
+#define KUNIT_STATIC_STUB_REDIRECT(real_fn_name, args...) do { } while (0)
+#endif
+
 #endif // _VIRTIO_VMMCI_H
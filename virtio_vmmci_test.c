@@ -0,0 +1,731 @@
+/*
+ *  KUnit tests for the OpenBSD VMM control interface driver.
+ *
+ *  Copyright 2019 Dave Voutila
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+/*
+ * Included at the end of virtio_vmmci.c with CONFIG_VIRTIO_VMMCI_KUNIT_TEST,
+ * so the tests get at the driver's static functions. The device is a fake
+ * virtio_config_ops over a plain buffer, and the clock corrections are
+ * stubbed out, so nothing here touches real hardware or the system clock.
+ */
+#include <kunit/test.h>
+#include <linux/delay.h>
+
+/* The timed cases make this many calls, each config access taking
+ * VMMCI_TEST_ACCESS_NS on top to stand in for the trap out to vmd(8).
+ * They only report, there's nothing to compare against.
+ */
+#define VMMCI_TEST_CALLS	1000
+#define VMMCI_TEST_ACCESS_NS	2000
+
+struct vmmci_test_dev {
+	struct virtio_device vdev;
+	struct virtio_vmmci *vmmci;
+
+	/* The fake config space, and what the host clock reads */
+	u8 config[64];
+	struct vmmci_time_snapshot time;
+	unsigned int sets;
+	unsigned int set_offset;
+	unsigned int delay_ns;		/* spent in every get and set */
+
+	/* What the stubbed clock corrections were asked to do */
+	unsigned int slews;
+	unsigned int steps;
+	s64 slewed;
+	s64 stepped;
+	int slew_rc;
+
+	/* Module parameters the tests change, put back on exit */
+	unsigned int freq_window;
+	bool freq_correct;
+	unsigned int sync_min_interval_ms;
+	unsigned int auto_slew_us;
+	unsigned int auto_step_us;
+	unsigned int auto_alert_ms;
+	unsigned int auto_hold_ms;
+	unsigned int monitor_stable_us;
+};
+
+static struct vmmci_test_dev *vmmci_test_dev(void)
+{
+	return kunit_get_current_test()->priv;
+}
+
+static void vmmci_test_get(struct virtio_device *vdev, unsigned offset,
+			   void *buf, unsigned len)
+{
+	struct vmmci_test_dev *td = container_of(vdev, struct vmmci_test_dev,
+	    vdev);
+
+	if (td->delay_ns)
+		ndelay(td->delay_ns);
+	if (offset == VMMCI_CONFIG_TIME_SEC && len == sizeof(td->time)) {
+		memcpy(buf, &td->time, len);
+		return;
+	}
+	memcpy(buf, td->config + offset, len);
+}
+
+static void vmmci_test_set(struct virtio_device *vdev, unsigned offset,
+			   const void *buf, unsigned len)
+{
+	struct vmmci_test_dev *td = container_of(vdev, struct vmmci_test_dev,
+	    vdev);
+
+	if (td->delay_ns)
+		ndelay(td->delay_ns);
+	memcpy(td->config + offset, buf, len);
+	td->sets++;
+	td->set_offset = offset;
+}
+
+static const struct virtio_config_ops vmmci_test_config_ops = {
+	.get	= vmmci_test_get,
+	.set	= vmmci_test_set,
+};
+
+static int vmmci_test_step_clock(s64 offset)
+{
+	struct vmmci_test_dev *td = vmmci_test_dev();
+
+	td->steps++;
+	td->stepped = offset;
+	return 0;
+}
+
+static int vmmci_test_slew_clock(s64 offset)
+{
+	struct vmmci_test_dev *td = vmmci_test_dev();
+
+	if (td->slew_rc)
+		return td->slew_rc;
+	td->slews++;
+	td->slewed = offset;
+	return 0;
+}
+
+static void vmmci_test_work(struct work_struct *work)
+{
+}
+
+static void vmmci_test_set_cmd(struct vmmci_test_dev *td, s32 cmd)
+{
+	memcpy(td->config + VMMCI_CONFIG_COMMAND, &cmd, sizeof(cmd));
+}
+
+/* Sets the host clock to the guest's realtime plus offset nanoseconds */
+static void vmmci_test_set_host(struct vmmci_test_dev *td, s64 offset)
+{
+	struct timespec64 ts;
+
+	ktime_get_real_ts64(&ts);
+	ts = ns_to_timespec64(timespec64_to_ns(&ts) + offset);
+	td->time.sec = ts.tv_sec;
+	td->time.usec = ts.tv_nsec / NSEC_PER_USEC;
+}
+
+static void vmmci_test_report_calls(struct kunit *test, const char *what,
+				    ktime_t start)
+{
+	struct vmmci_test_dev *td = test->priv;
+
+	kunit_info(test, "%s: %lld ns per call, %u ns per access\n", what,
+	    div_s64(ktime_to_ns(ktime_sub(ktime_get(), start)),
+	    VMMCI_TEST_CALLS), td->delay_ns);
+}
+
+static void vmmci_test_run_monitor(struct virtio_vmmci *vmmci)
+{
+	monitor_work_func(&vmmci->monitor_work.work);
+}
+
+static int vmmci_test_init(struct kunit *test)
+{
+	struct vmmci_test_dev *td;
+	struct virtio_vmmci *vmmci;
+
+	// commands and syncs are queued on it, if not run
+	KUNIT_ASSERT_NOT_NULL(test, vmmci_wq);
+
+	td = kunit_kzalloc(test, sizeof(*td), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, td);
+	vmmci = kunit_kzalloc(test, sizeof(*vmmci), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, vmmci);
+	vmmci->counters = alloc_percpu(struct vmmci_counters);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, vmmci->counters);
+
+	// only what probe sets up that the tests get to, with work that
+	// does nothing so a queued command or sync goes nowhere
+	td->vdev.config = &vmmci_test_config_ops;
+	td->vdev.dev.driver = &virtio_vmmci_driver.driver;
+	td->vdev.dev.init_name = "vmmci-test";
+	td->vdev.priv = vmmci;
+	vmmci->vdev = &td->vdev;
+	INIT_WORK(&vmmci->cmd_work, vmmci_test_work);
+	INIT_KFIFO(vmmci->cmd_queue);
+	spin_lock_init(&vmmci->cmd_lock);
+	seqlock_init(&vmmci->drift_lock);
+	mutex_init(&vmmci->report_lock);
+	mutex_init(&vmmci->correct_lock);
+	INIT_DELAYED_WORK(&vmmci->sync_work, vmmci_test_work);
+	INIT_DEFERRABLE_WORK(&vmmci->monitor_work, vmmci_test_work);
+	vmmci->monitor_interval = monitor_min_interval();
+	vmmci->correct_mode = VMMCI_CORRECT_STEP;
+	vmmci->step_threshold_us = step_threshold_us;
+	td->vmmci = vmmci;
+
+	td->freq_window = freq_window;
+	td->freq_correct = freq_correct;
+	td->sync_min_interval_ms = sync_min_interval_ms;
+	td->auto_slew_us = auto_slew_us;
+	td->auto_step_us = auto_step_us;
+	td->auto_alert_ms = auto_alert_ms;
+	td->auto_hold_ms = auto_hold_ms;
+	td->monitor_stable_us = monitor_stable_us;
+	test->priv = td;
+
+	kunit_activate_static_stub(test, step_clock, vmmci_test_step_clock);
+	kunit_activate_static_stub(test, slew_clock, vmmci_test_slew_clock);
+	return 0;
+}
+
+static void vmmci_test_exit(struct kunit *test)
+{
+	struct vmmci_test_dev *td = test->priv;
+
+	if (!td)
+		return;
+
+	cancel_work_sync(&td->vmmci->cmd_work);
+	cancel_delayed_work_sync(&td->vmmci->sync_work);
+	cancel_delayed_work_sync(&td->vmmci->monitor_work);
+	free_percpu(td->vmmci->counters);
+
+	freq_window = td->freq_window;
+	freq_correct = td->freq_correct;
+	sync_min_interval_ms = td->sync_min_interval_ms;
+	auto_slew_us = td->auto_slew_us;
+	auto_step_us = td->auto_step_us;
+	auto_alert_ms = td->auto_alert_ms;
+	auto_hold_ms = td->auto_hold_ms;
+	monitor_stable_us = td->monitor_stable_us;
+}
+
+/* A host clock behind ours gives a negative offset, and the sysctl split
+ * of it keeps the nanoseconds positive like a timespec does.
+ */
+static void vmmci_test_drift_negative(struct kunit *test)
+{
+	struct vmmci_test_dev *td = test->priv;
+	struct virtio_vmmci *vmmci = td->vmmci;
+	struct vmmci_sample sample;
+	char buf[80];
+
+	vmmci_test_set_host(td, -5250 * NSEC_PER_MSEC);
+	take_sample(vmmci, &sample);
+
+	KUNIT_EXPECT_LE(test, sample.offset, -5250 * NSEC_PER_MSEC);
+	KUNIT_EXPECT_GT(test, sample.offset, -6250 * NSEC_PER_MSEC);
+	KUNIT_EXPECT_EQ(test, sample.offset, sample.host - sample.guest);
+	KUNIT_EXPECT_GE(test, sample.delay, 0);
+
+	vmmci->drift.offset = -1250 * NSEC_PER_MSEC;
+	KUNIT_EXPECT_EQ(test, vmmci_stat(vmmci, VMMCI_STAT_DRIFT_SEC), -2);
+	KUNIT_EXPECT_EQ(test, vmmci_stat(vmmci, VMMCI_STAT_DRIFT_NSEC),
+	    750 * NSEC_PER_MSEC);
+
+	drift_state_format(&vmmci->drift, buf, sizeof(buf));
+	KUNIT_EXPECT_STREQ(test, buf, "-1250000000 0 0 0");
+}
+
+/* Retries the transport needed show up in the counters */
+static void vmmci_test_time_retries(struct kunit *test)
+{
+	struct vmmci_test_dev *td = test->priv;
+	struct timespec64 host;
+
+	td->time.sec = 1000;
+	td->time.usec = 250;
+	td->time.retries = 2;
+	td->time.reads = 7;
+	read_host_time(td->vmmci, &host);
+
+	KUNIT_EXPECT_EQ(test, host.tv_sec, 1000);
+	KUNIT_EXPECT_EQ(test, host.tv_nsec, 250 * NSEC_PER_USEC);
+	KUNIT_EXPECT_EQ(test,
+	    vmmci_counter_sum(td->vmmci, VMMCI_CNT_TIME_RETRIES), 2);
+}
+
+/* Each access width lands in its own histogram, a whole time snapshot in
+ * get_time rather than any of them, and an odd width in none.
+ */
+static void vmmci_test_accessors(struct kunit *test)
+{
+	struct vmmci_test_dev *td = test->priv;
+	struct virtio_vmmci *vmmci = td->vmmci;
+	u8 b = 0x5a, b2;
+	__le16 w = cpu_to_le16(0x1234), w2;
+	__le32 l = cpu_to_le32(0x89abcdef), l2;
+	__le64 q = cpu_to_le64(0x0123456789abcdefULL), q2;
+	struct timespec64 host;
+	u8 odd[3];
+	int id;
+
+	vmmci_set(vmmci, 0, &b, sizeof(b));
+	vmmci_set(vmmci, 2, &w, sizeof(w));
+	vmmci_set(vmmci, 4, &l, sizeof(l));
+	vmmci_set(vmmci, 8, &q, sizeof(q));
+	KUNIT_EXPECT_EQ(test, td->sets, 4);
+
+	vmmci_get(vmmci, 0, &b2, sizeof(b2));
+	vmmci_get(vmmci, 2, &w2, sizeof(w2));
+	vmmci_get(vmmci, 4, &l2, sizeof(l2));
+	vmmci_get(vmmci, 8, &q2, sizeof(q2));
+	KUNIT_EXPECT_EQ(test, b2, 0x5a);
+	KUNIT_EXPECT_EQ(test, le16_to_cpu(w2), 0x1234);
+	KUNIT_EXPECT_EQ(test, le32_to_cpu(l2), 0x89abcdef);
+	KUNIT_EXPECT_EQ(test, le64_to_cpu(q2), 0x0123456789abcdefULL);
+
+	for (id = VMMCI_HIST_GET_1; id <= VMMCI_HIST_GET_8; id++)
+		KUNIT_EXPECT_EQ(test, atomic64_read(&vmmci->hist[id].count), 1);
+	for (id = VMMCI_HIST_SET_1; id <= VMMCI_HIST_SET_8; id++)
+		KUNIT_EXPECT_EQ(test, atomic64_read(&vmmci->hist[id].count), 1);
+
+	vmmci_get(vmmci, 16, odd, sizeof(odd));
+	read_host_time(vmmci, &host);
+	for (id = VMMCI_HIST_GET_1; id <= VMMCI_HIST_GET_8; id++)
+		KUNIT_EXPECT_EQ(test, atomic64_read(&vmmci->hist[id].count), 1);
+	KUNIT_EXPECT_EQ(test,
+	    atomic64_read(&vmmci->hist[VMMCI_HIST_GET_TIME].count), 1);
+}
+
+/* A slow device shows up in the histograms and the sample's round-trip */
+static void vmmci_test_slow_access(struct kunit *test)
+{
+	struct vmmci_test_dev *td = test->priv;
+	struct virtio_vmmci *vmmci = td->vmmci;
+	struct vmmci_sample sample;
+	u32 l = 0;
+
+	td->delay_ns = 50 * NSEC_PER_USEC;
+	vmmci_test_set_host(td, 0);
+	take_sample(vmmci, &sample);
+	KUNIT_EXPECT_GE(test, sample.delay, td->delay_ns);
+	KUNIT_EXPECT_GE(test,
+	    atomic64_read(&vmmci->hist[VMMCI_HIST_GET_TIME].max), td->delay_ns);
+
+	vmmci_set(vmmci, 0, &l, sizeof(l));
+	KUNIT_EXPECT_GE(test,
+	    atomic64_read(&vmmci->hist[VMMCI_HIST_SET_4].max), td->delay_ns);
+}
+
+static void vmmci_test_time_read_host_time(struct kunit *test)
+{
+	struct vmmci_test_dev *td = test->priv;
+	struct timespec64 host;
+	ktime_t start;
+	int i;
+
+	td->delay_ns = VMMCI_TEST_ACCESS_NS;
+	vmmci_test_set_host(td, 0);
+
+	start = ktime_get();
+	for (i = 0; i < VMMCI_TEST_CALLS; i++)
+		read_host_time(td->vmmci, &host);
+	vmmci_test_report_calls(test, "read_host_time", start);
+
+	KUNIT_EXPECT_EQ(test,
+	    atomic64_read(&td->vmmci->hist[VMMCI_HIST_GET_TIME].count),
+	    VMMCI_TEST_CALLS);
+}
+
+static void vmmci_test_time_take_sample(struct kunit *test)
+{
+	struct vmmci_test_dev *td = test->priv;
+	struct vmmci_sample sample;
+	ktime_t start;
+	int i;
+
+	td->delay_ns = VMMCI_TEST_ACCESS_NS;
+	vmmci_test_set_host(td, 0);
+
+	start = ktime_get();
+	for (i = 0; i < VMMCI_TEST_CALLS; i++)
+		take_sample(td->vmmci, &sample);
+	vmmci_test_report_calls(test, "take_sample", start);
+
+	KUNIT_EXPECT_GE(test, sample.delay, td->delay_ns);
+}
+
+static void vmmci_test_time_take_best_sample(struct kunit *test)
+{
+	struct vmmci_test_dev *td = test->priv;
+	struct vmmci_sample sample;
+	ktime_t start;
+	int i;
+
+	td->delay_ns = VMMCI_TEST_ACCESS_NS;
+	vmmci_test_set_host(td, 0);
+
+	start = ktime_get();
+	for (i = 0; i < VMMCI_TEST_CALLS; i++)
+		take_best_sample(td->vmmci, &sample);
+	vmmci_test_report_calls(test, "take_best_sample", start);
+
+	KUNIT_EXPECT_EQ(test,
+	    atomic64_read(&td->vmmci->hist[VMMCI_HIST_GET_TIME].count),
+	    (s64) VMMCI_TEST_CALLS * READ_ONCE(burst));
+}
+
+/* A monitor run publishes and records its sample and queues the next,
+ * backing off while the drift holds still.
+ */
+static void vmmci_test_monitor(struct kunit *test)
+{
+	struct vmmci_test_dev *td = test->priv;
+	struct virtio_vmmci *vmmci = td->vmmci;
+	struct vmmci_drift_state st;
+
+	// however long the runs take in between, the drift holds still
+	monitor_stable_us = USEC_PER_SEC;
+	vmmci_test_set_host(td, 3 * NSEC_PER_MSEC);
+
+	vmmci->monitor_due = ktime_get();
+	vmmci_test_run_monitor(vmmci);
+
+	drift_state_read(&vmmci->drift_lock, &vmmci->drift, &st);
+	KUNIT_EXPECT_EQ(test, st.samples, 1);
+	KUNIT_EXPECT_LE(test, st.offset, 3 * NSEC_PER_MSEC);
+	KUNIT_EXPECT_GT(test, st.offset, 0);
+	KUNIT_EXPECT_EQ(test, vmmci->drift_head, 1);
+	KUNIT_EXPECT_TRUE(test, vmmci->monitor_has_prev);
+	KUNIT_EXPECT_EQ(test, vmmci->monitor_interval, monitor_min_interval());
+	KUNIT_EXPECT_TRUE(test, delayed_work_pending(&vmmci->monitor_work));
+	KUNIT_EXPECT_EQ(test, vmmci_counter_sum(vmmci, VMMCI_CNT_MONITOR_RUNS), 1);
+	KUNIT_EXPECT_EQ(test,
+	    atomic64_read(&vmmci->hist[VMMCI_HIST_MONITOR_LATE].count), 1);
+
+	vmmci_test_run_monitor(vmmci);
+	KUNIT_EXPECT_EQ(test, vmmci->monitor_interval,
+	    min(2 * monitor_min_interval(), monitor_max_interval()));
+	KUNIT_EXPECT_EQ(test, vmmci->drift_head, 2);
+
+	// a sync puts it back to the shortest interval, measuring afresh
+	monitor_tighten(vmmci);
+	KUNIT_EXPECT_FALSE(test, vmmci->monitor_has_prev);
+	KUNIT_EXPECT_EQ(test, vmmci->monitor_interval, monitor_min_interval());
+	KUNIT_EXPECT_EQ(test, vmmci_stat(vmmci, VMMCI_STAT_SYNC_REQUESTS), 0);
+
+	// and once stopping it doesn't queue itself again
+	WRITE_ONCE(vmmci->stopping, true);
+	cancel_delayed_work_sync(&vmmci->monitor_work);
+	vmmci_test_run_monitor(vmmci);
+	KUNIT_EXPECT_FALSE(test, delayed_work_pending(&vmmci->monitor_work));
+	KUNIT_EXPECT_EQ(test, vmmci_counter_sum(vmmci, VMMCI_CNT_MONITOR_RUNS), 3);
+}
+
+/* The host clock leaping ahead of our raw clock between two runs is a
+ * host suspend, which gets a sync rather than a drift correction.
+ */
+static void vmmci_test_monitor_suspend(struct kunit *test)
+{
+	struct vmmci_test_dev *td = test->priv;
+	struct virtio_vmmci *vmmci = td->vmmci;
+
+	vmmci_test_set_host(td, 0);
+	vmmci_test_run_monitor(vmmci);
+	KUNIT_EXPECT_EQ(test, vmmci_stat(vmmci, VMMCI_STAT_SYNC_REQUESTS), 0);
+
+	vmmci_test_set_host(td, 10 * NSEC_PER_SEC);
+	vmmci_test_run_monitor(vmmci);
+	KUNIT_EXPECT_EQ(test, vmmci_stat(vmmci, VMMCI_STAT_SYNC_REQUESTS), 1);
+	KUNIT_EXPECT_EQ(test, vmmci->monitor_interval, monitor_min_interval());
+	KUNIT_EXPECT_EQ(test, td->slews + td->steps, 0);
+}
+
+/* With VMMCI_F_ACK the command is written back before it's queued */
+static void vmmci_test_ack(struct kunit *test)
+{
+	struct vmmci_test_dev *td = test->priv;
+	struct virtio_vmmci *vmmci = td->vmmci;
+	struct vmmci_cmd_entry entry;
+	s32 cmd;
+
+	__virtio_set_bit(&td->vdev, VMMCI_F_ACK);
+	vmmci_test_set_cmd(td, VMMCI_SYNCRTC);
+	vmmci_changed(&td->vdev);
+
+	KUNIT_EXPECT_EQ(test, td->sets, 1);
+	KUNIT_EXPECT_EQ(test, td->set_offset, VMMCI_CONFIG_COMMAND);
+	memcpy(&cmd, td->config + VMMCI_CONFIG_COMMAND, sizeof(cmd));
+	KUNIT_EXPECT_EQ(test, cmd, VMMCI_SYNCRTC);
+
+	KUNIT_EXPECT_EQ(test, vmmci_counter_sum(vmmci, VMMCI_CNT_CONFIG_IRQS_CMD), 1);
+	KUNIT_EXPECT_EQ(test, vmmci_counter_sum(vmmci, VMMCI_CNT_CMD_SYNCRTC), 1);
+	KUNIT_EXPECT_EQ(test, vmmci_counter_sum(vmmci, VMMCI_CNT_ACKS), 1);
+	KUNIT_EXPECT_GE(test, vmmci_stat(vmmci, VMMCI_STAT_ACK_LATENCY), 0);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&vmmci->hist[VMMCI_HIST_IRQ].count), 1);
+
+	KUNIT_ASSERT_EQ(test, kfifo_out(&vmmci->cmd_queue, &entry, 1), 1);
+	KUNIT_EXPECT_EQ(test, entry.cmd, VMMCI_SYNCRTC);
+	KUNIT_EXPECT_TRUE(test, entry.acked);
+}
+
+/* Without it the command is only queued, and VMMCI_NONE not even that */
+static void vmmci_test_no_ack(struct kunit *test)
+{
+	struct vmmci_test_dev *td = test->priv;
+	struct virtio_vmmci *vmmci = td->vmmci;
+	struct vmmci_cmd_entry entry;
+
+	vmmci_test_set_cmd(td, VMMCI_SHUTDOWN);
+	vmmci_changed(&td->vdev);
+
+	KUNIT_EXPECT_EQ(test, td->sets, 0);
+	KUNIT_EXPECT_EQ(test, vmmci_counter_sum(vmmci, VMMCI_CNT_CMD_SHUTDOWN), 1);
+	KUNIT_EXPECT_EQ(test, vmmci_counter_sum(vmmci, VMMCI_CNT_ACKS), 0);
+	KUNIT_ASSERT_EQ(test, kfifo_out(&vmmci->cmd_queue, &entry, 1), 1);
+	KUNIT_EXPECT_EQ(test, entry.cmd, VMMCI_SHUTDOWN);
+	KUNIT_EXPECT_FALSE(test, entry.acked);
+
+	vmmci_test_set_cmd(td, VMMCI_NONE);
+	vmmci_changed(&td->vdev);
+
+	KUNIT_EXPECT_EQ(test, vmmci_counter_sum(vmmci, VMMCI_CNT_CONFIG_IRQS_CMD), 1);
+	KUNIT_EXPECT_TRUE(test, kfifo_is_empty(&vmmci->cmd_queue));
+	KUNIT_EXPECT_EQ(test, atomic64_read(&vmmci->hist[VMMCI_HIST_IRQ].count), 2);
+}
+
+/* Requests while a sync is pending fold into it, and none are taken once
+ * the device is stopping.
+ */
+static void vmmci_test_sync_coalescing(struct kunit *test)
+{
+	struct vmmci_test_dev *td = test->priv;
+	struct virtio_vmmci *vmmci = td->vmmci;
+
+	// inside the rate limit, so the first request stays pending
+	sync_min_interval_ms = 60000;
+	vmmci->sync_ran = true;
+	vmmci->sync_last = jiffies;
+
+	vmmci_request_sync(vmmci);
+	KUNIT_EXPECT_TRUE(test, delayed_work_pending(&vmmci->sync_work));
+	vmmci_request_sync(vmmci);
+	vmmci_request_sync(vmmci);
+
+	KUNIT_EXPECT_EQ(test, vmmci_stat(vmmci, VMMCI_STAT_SYNC_REQUESTS), 3);
+	KUNIT_EXPECT_EQ(test, vmmci_stat(vmmci, VMMCI_STAT_SYNC_COALESCED), 2);
+
+	WRITE_ONCE(vmmci->stopping, true);
+	vmmci_request_sync(vmmci);
+	KUNIT_EXPECT_EQ(test, vmmci_stat(vmmci, VMMCI_STAT_SYNC_REQUESTS), 3);
+}
+
+/* Feeds update_freq a host clock running ppb faster than our raw clock,
+ * sampled every secs seconds
+ */
+static void vmmci_test_feed_freq(struct virtio_vmmci *vmmci, s64 ppb,
+				 unsigned int n, unsigned int secs)
+{
+	struct vmmci_sample sample = { 0 };
+	s64 base = 1000 * NSEC_PER_SEC;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		sample.raw = base + (s64) i * secs * NSEC_PER_SEC;
+		sample.host = sample.raw + 3 * NSEC_PER_SEC + (s64) i * secs * ppb;
+		update_freq(vmmci, &sample);
+	}
+}
+
+static void vmmci_test_update_freq(struct kunit *test)
+{
+	struct vmmci_test_dev *td = test->priv;
+	struct virtio_vmmci *vmmci = td->vmmci;
+	struct vmmci_sample jump = { 0 };
+
+	freq_window = 8;
+	freq_correct = false;
+
+	// nothing until there are enough samples to fit
+	vmmci_test_feed_freq(vmmci, 100000, VMMCI_FREQ_MIN_SAMPLES - 1, 1);
+	KUNIT_EXPECT_EQ(test, vmmci_stat(vmmci, VMMCI_STAT_FREQ_PPB), 0);
+
+	vmmci->freq_count = 0;
+	vmmci_test_feed_freq(vmmci, 100000, 12, 1);
+	KUNIT_EXPECT_EQ(test, vmmci->freq_count, 8);
+	KUNIT_EXPECT_LE(test, abs(vmmci_stat(vmmci, VMMCI_STAT_FREQ_PPB) - 100000), 100);
+
+	vmmci->freq_count = 0;
+	vmmci_test_feed_freq(vmmci, -50000, 8, 1);
+	KUNIT_EXPECT_LE(test, abs(vmmci_stat(vmmci, VMMCI_STAT_FREQ_PPB) + 50000), 100);
+
+	// the widest window at the longest default interval, whose sums
+	// used to overflow
+	freq_window = VMMCI_FREQ_WINDOW_MAX;
+	vmmci->freq_count = 0;
+	vmmci_test_feed_freq(vmmci, 400000, VMMCI_FREQ_WINDOW_MAX, 320);
+	KUNIT_EXPECT_LE(test, abs(vmmci_stat(vmmci, VMMCI_STAT_FREQ_PPB) - 400000), 100);
+
+	// and points beyond VMMCI_FREQ_SPAN_MAX_MS are left out
+	vmmci->freq_count = 0;
+	vmmci_test_feed_freq(vmmci, -300000, VMMCI_FREQ_WINDOW_MAX, 3600);
+	KUNIT_EXPECT_LE(test, abs(vmmci_stat(vmmci, VMMCI_STAT_FREQ_PPB) + 300000), 100);
+
+	// a second's jump is no frequency error, so the fit starts over
+	jump.raw = 1008 * NSEC_PER_SEC;
+	jump.host = jump.raw + 4 * NSEC_PER_SEC;
+	update_freq(vmmci, &jump);
+	KUNIT_EXPECT_EQ(test, vmmci->freq_count, 1);
+}
+
+static void vmmci_test_hist_add(struct kunit *test)
+{
+	struct vmmci_test_dev *td = test->priv;
+	struct vmmci_hist *h = &td->vmmci->hist[VMMCI_HIST_SYNC];
+
+	vmmci_hist_add(td->vmmci, VMMCI_HIST_SYNC, -5);
+	vmmci_hist_add(td->vmmci, VMMCI_HIST_SYNC, 0);
+	vmmci_hist_add(td->vmmci, VMMCI_HIST_SYNC, 1);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&h->buckets[0]), 3);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&h->sum), 1);
+
+	vmmci_hist_add(td->vmmci, VMMCI_HIST_SYNC, 2);
+	vmmci_hist_add(td->vmmci, VMMCI_HIST_SYNC, 3);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&h->buckets[1]), 2);
+
+	vmmci_hist_add(td->vmmci, VMMCI_HIST_SYNC, 1024);
+	vmmci_hist_add(td->vmmci, VMMCI_HIST_SYNC, 2047);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&h->buckets[10]), 2);
+
+	vmmci_hist_add(td->vmmci, VMMCI_HIST_SYNC, S64_MAX / 2);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&h->buckets[VMMCI_HIST_BUCKETS - 1]), 1);
+
+	KUNIT_EXPECT_EQ(test, atomic64_read(&h->count), 8);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&h->max), S64_MAX / 2);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&td->vmmci->hist[VMMCI_HIST_IRQ].count), 0);
+}
+
+/* The band, the slew/step split and the hold time */
+static void vmmci_test_auto_correct(struct kunit *test)
+{
+	struct vmmci_test_dev *td = test->priv;
+	struct virtio_vmmci *vmmci = td->vmmci;
+	struct vmmci_sample sample = { 0 };
+
+	auto_slew_us = 1000;
+	auto_step_us = 128000;
+	auto_alert_ms = 60000;
+	auto_hold_ms = 60000;
+
+	sample.offset = -200 * NSEC_PER_USEC;
+	auto_correct_apply(vmmci, &sample);
+	KUNIT_EXPECT_EQ(test, vmmci->auto_state, VMMCI_AUTO_SETTLED);
+
+	// settled, so it's let be anywhere inside the band
+	sample.offset = -800 * NSEC_PER_USEC;
+	auto_correct_apply(vmmci, &sample);
+	KUNIT_EXPECT_EQ(test, vmmci->auto_state, VMMCI_AUTO_SETTLED);
+	KUNIT_EXPECT_EQ(test, td->slews + td->steps, 0);
+
+	sample.offset = -5 * NSEC_PER_MSEC;
+	auto_correct_apply(vmmci, &sample);
+	KUNIT_EXPECT_EQ(test, vmmci->auto_state, VMMCI_AUTO_CORRECTING);
+	KUNIT_EXPECT_EQ(test, td->slews, 1);
+	KUNIT_EXPECT_EQ(test, td->slewed, -5 * NSEC_PER_MSEC);
+
+	// held off, and then short of the band it isn't settled yet
+	auto_correct_apply(vmmci, &sample);
+	KUNIT_EXPECT_EQ(test, td->slews, 1);
+	sample.offset = -800 * NSEC_PER_USEC;
+	auto_correct_apply(vmmci, &sample);
+	KUNIT_EXPECT_EQ(test, vmmci->auto_state, VMMCI_AUTO_CORRECTING);
+
+	auto_hold_ms = 0;
+	sample.offset = -200 * NSEC_PER_MSEC;
+	auto_correct_apply(vmmci, &sample);
+	KUNIT_EXPECT_EQ(test, td->steps, 1);
+	KUNIT_EXPECT_EQ(test, td->stepped, -200 * NSEC_PER_MSEC);
+	KUNIT_EXPECT_EQ(test, vmmci_stat(vmmci, VMMCI_STAT_AUTO_SLEWS), 1);
+	KUNIT_EXPECT_EQ(test, vmmci_stat(vmmci, VMMCI_STAT_AUTO_STEPS), 1);
+
+	// a slew that fails is stepped instead
+	td->slew_rc = -EOPNOTSUPP;
+	sample.offset = 5 * NSEC_PER_MSEC;
+	auto_correct_apply(vmmci, &sample);
+	KUNIT_EXPECT_EQ(test, td->steps, 2);
+	KUNIT_EXPECT_EQ(test, td->stepped, 5 * NSEC_PER_MSEC);
+}
+
+/* Beyond auto_alert_ms it only warns, once, until back under half of it */
+static void vmmci_test_auto_correct_alert(struct kunit *test)
+{
+	struct vmmci_test_dev *td = test->priv;
+	struct virtio_vmmci *vmmci = td->vmmci;
+	struct vmmci_sample sample = { 0 };
+
+	auto_slew_us = 1000;
+	auto_step_us = 128000;
+	auto_alert_ms = 60000;
+	auto_hold_ms = 0;
+
+	sample.offset = -90 * NSEC_PER_SEC;
+	auto_correct_apply(vmmci, &sample);
+	auto_correct_apply(vmmci, &sample);
+	KUNIT_EXPECT_EQ(test, vmmci->auto_state, VMMCI_AUTO_ALERT);
+	KUNIT_EXPECT_EQ(test, vmmci_stat(vmmci, VMMCI_STAT_AUTO_ALERTS), 1);
+
+	sample.offset = -40 * NSEC_PER_SEC;
+	auto_correct_apply(vmmci, &sample);
+	KUNIT_EXPECT_EQ(test, vmmci->auto_state, VMMCI_AUTO_ALERT);
+	KUNIT_EXPECT_EQ(test, td->slews + td->steps, 0);
+
+	sample.offset = -10 * NSEC_PER_MSEC;
+	auto_correct_apply(vmmci, &sample);
+	KUNIT_EXPECT_EQ(test, vmmci->auto_state, VMMCI_AUTO_CORRECTING);
+	KUNIT_EXPECT_EQ(test, td->slews, 1);
+	KUNIT_EXPECT_EQ(test, td->slewed, -10 * NSEC_PER_MSEC);
+}
+
+static struct kunit_case vmmci_test_cases[] = {
+	KUNIT_CASE(vmmci_test_drift_negative),
+	KUNIT_CASE(vmmci_test_time_retries),
+	KUNIT_CASE(vmmci_test_accessors),
+	KUNIT_CASE(vmmci_test_slow_access),
+	KUNIT_CASE(vmmci_test_time_read_host_time),
+	KUNIT_CASE(vmmci_test_time_take_sample),
+	KUNIT_CASE(vmmci_test_time_take_best_sample),
+	KUNIT_CASE(vmmci_test_monitor),
+	KUNIT_CASE(vmmci_test_monitor_suspend),
+	KUNIT_CASE(vmmci_test_ack),
+	KUNIT_CASE(vmmci_test_no_ack),
+	KUNIT_CASE(vmmci_test_sync_coalescing),
+	KUNIT_CASE(vmmci_test_update_freq),
+	KUNIT_CASE(vmmci_test_hist_add),
+	KUNIT_CASE(vmmci_test_auto_correct),
+	KUNIT_CASE(vmmci_test_auto_correct_alert),
+	{ },
+};
+
+static struct kunit_suite vmmci_test_suite = {
+	.name		= "virtio_vmmci",
+	.init		= vmmci_test_init,
+	.exit		= vmmci_test_exit,
+	.test_cases	= vmmci_test_cases,
+};
+
+kunit_test_suite(vmmci_test_suite);
@@ -0,0 +1,140 @@
+/*
+ *  Implementation of an OpenBSD VMM control interface for Linux guests
+ *  running under an OpenBSD host.
+ *
+ *  Copyright 2019 Dave Voutila
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Tracepoints for the vmmci driver, see /sys/kernel/tracing/events/vmmci.
+ * Devices are identified by their virtio index (N in virtioN).
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM vmmci
+
+#if !defined(_VIRTIO_VMMCI_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _VIRTIO_VMMCI_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(vmmci_command,
+	TP_PROTO(int dev, s32 cmd),
+	TP_ARGS(dev, cmd),
+
+	TP_STRUCT__entry(
+		__field(int, dev)
+		__field(s32, cmd)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->cmd = cmd;
+	),
+
+	TP_printk("virtio%d cmd=%d", __entry->dev, __entry->cmd)
+);
+
+TRACE_EVENT(vmmci_ack,
+	TP_PROTO(int dev, s32 cmd, s64 latency),
+	TP_ARGS(dev, cmd, latency),
+
+	TP_STRUCT__entry(
+		__field(int, dev)
+		__field(s32, cmd)
+		__field(s64, latency)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->cmd = cmd;
+		__entry->latency = latency;
+	),
+
+	TP_printk("virtio%d cmd=%d latency=%lld ns", __entry->dev,
+		  __entry->cmd, __entry->latency)
+);
+
+TRACE_EVENT(vmmci_sample,
+	TP_PROTO(int dev, s64 host, s64 guest, s64 offset, s64 delay),
+	TP_ARGS(dev, host, guest, offset, delay),
+
+	TP_STRUCT__entry(
+		__field(int, dev)
+		__field(s64, host)
+		__field(s64, guest)
+		__field(s64, offset)
+		__field(s64, delay)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->host = host;
+		__entry->guest = guest;
+		__entry->offset = offset;
+		__entry->delay = delay;
+	),
+
+	TP_printk("virtio%d host=%lld guest=%lld offset=%lld delay=%lld",
+		  __entry->dev, __entry->host, __entry->guest,
+		  __entry->offset, __entry->delay)
+);
+
+TRACE_EVENT(vmmci_sync_start,
+	TP_PROTO(int dev),
+	TP_ARGS(dev),
+
+	TP_STRUCT__entry(
+		__field(int, dev)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dev;
+	),
+
+	TP_printk("virtio%d", __entry->dev)
+);
+
+TRACE_EVENT(vmmci_sync_end,
+	TP_PROTO(int dev, int rc, s64 before, s64 after),
+	TP_ARGS(dev, rc, before, after),
+
+	TP_STRUCT__entry(
+		__field(int, dev)
+		__field(int, rc)
+		__field(s64, before)
+		__field(s64, after)
+	),
+
+	TP_fast_assign(
+		__entry->dev = dev;
+		__entry->rc = rc;
+		__entry->before = before;
+		__entry->after = after;
+	),
+
+	TP_printk("virtio%d rc=%d offset before=%lld after=%lld",
+		  __entry->dev, __entry->rc, __entry->before, __entry->after)
+);
+
+#endif // _VIRTIO_VMMCI_TRACE_H
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE virtio_vmmci_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,137 @@
+/*
+ *  Implementation of an OpenBSD VMM control interface for Linux guests
+ *  running under an OpenBSD host.
+ *
+ *  Copyright 2019 Dave Voutila
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Interfaces shared between the vmmci driver and userspace. Safe to
+ * include from either side.
+ */
+#ifndef _VIRTIO_VMMCI_UAPI_H
+#define _VIRTIO_VMMCI_UAPI_H
+
+#include <linux/types.h>
+
+#define VMMCI_DEVICE_PATH	"/dev/vmmci"
+
+/*
+ * The time page, mmap(2)-ed read-only from /dev/vmmci. The driver updates
+ * it after every drift sample under a sequence counter the same way the
+ * vDSO does: seq is odd while an update is in progress, so readers retry
+ * until they see the same even value before and after reading. See
+ * vmmci_time_page_read() below.
+ *
+ * To get the host time now, carry host_ns forward by how much one of the
+ * guest clocks moved since guest_*_ns (or guest_tsc) was taken, scaled by
+ * freq_ppb if you care about the rate difference.
+ */
+#define VMMCI_TIME_PAGE_VERSION	1
+
+struct vmmci_time_page {
+	__u32 seq;
+	__u32 version;		/* VMMCI_TIME_PAGE_VERSION */
+	__u64 samples;		/* 0 until the first sample is published */
+	__s64 host_ns;		/* host realtime */
+	__s64 guest_real_ns;	/* guest CLOCK_REALTIME at host_ns */
+	__s64 guest_mono_ns;	/* guest CLOCK_MONOTONIC at host_ns */
+	__s64 guest_raw_ns;	/* guest CLOCK_MONOTONIC_RAW at host_ns */
+	__u64 guest_tsc;	/* guest TSC at host_ns, 0 without one */
+	__u64 tsc_khz;		/* TSC frequency, 0 without one */
+	__s64 offset_ns;	/* host - guest realtime */
+	__s64 delay_ns;		/* round-trip of the host reading */
+	__s64 freq_ppb;		/* host clock rate versus guest raw clock */
+};
+
+/*
+ * Drift history, read(2) from /sys/kernel/debug/vmmci/<device>/drift_history
+ * as an array of these. The file offset is the cursor: record n (seq n)
+ * lives at offset (n - 1) * sizeof(struct vmmci_drift_record), so keeping
+ * the file open, or seeking back to where you stopped, picks up where the
+ * last read left off. Reads return whole records only, and 0 when there's
+ * nothing new. Records older than the ring are gone; a jump in seq tells
+ * you how many you missed.
+ */
+#define VMMCI_DRIFT_SYNCED	(1 << 0)	/* a clock sync followed */
+
+struct vmmci_drift_record {
+	__u64 seq;		/* starts at 1 */
+	__s64 host_ns;		/* host realtime */
+	__s64 guest_ns;		/* guest realtime */
+	__s64 raw_ns;		/* guest CLOCK_MONOTONIC_RAW */
+	__s64 offset_ns;	/* host - guest */
+	__s64 delay_ns;		/* round-trip of the host reading */
+	__u32 flags;		/* VMMCI_DRIFT_* */
+	__u32 pad;
+};
+
+/*
+ * Events are multicast on the VMMCI_GENL_MCGRP_EVENTS group of the
+ * VMMCI_GENL_NAME generic netlink family. Each event is a message whose
+ * genl command is one of the VMMCI_EVENT_* values below and which carries
+ * VMMCI_ATTR_DEVICE plus the attributes listed with it.
+ */
+#define VMMCI_GENL_NAME		"vmmci"
+#define VMMCI_GENL_VERSION	1
+#define VMMCI_GENL_MCGRP_EVENTS	"events"
+
+enum vmmci_event {
+	VMMCI_EVENT_UNSPEC,
+	VMMCI_EVENT_COMMAND,	/* COMMAND, ACKED */
+	VMMCI_EVENT_SYNC,	/* ERROR, OFFSET_BEFORE, OFFSET_AFTER */
+	VMMCI_EVENT_SAMPLE,	/* HOST_NS, GUEST_NS, OFFSET, DELAY, FREQ_PPB */
+	VMMCI_EVENT_ERROR,	/* ERROR, optionally COMMAND */
+	__VMMCI_EVENT_MAX,
+};
+#define VMMCI_EVENT_MAX (__VMMCI_EVENT_MAX - 1)
+
+enum vmmci_attr {
+	VMMCI_ATTR_UNSPEC,
+	VMMCI_ATTR_PAD,
+	VMMCI_ATTR_DEVICE,		/* string, the virtio device name */
+	VMMCI_ATTR_COMMAND,		/* u32, a host command */
+	VMMCI_ATTR_ACKED,		/* flag, the command was acknowledged */
+	VMMCI_ATTR_ERROR,		/* s32, negative errno */
+	VMMCI_ATTR_OFFSET_BEFORE,	/* s64, ns */
+	VMMCI_ATTR_OFFSET_AFTER,	/* s64, ns */
+	VMMCI_ATTR_HOST_NS,		/* s64 */
+	VMMCI_ATTR_GUEST_NS,		/* s64 */
+	VMMCI_ATTR_OFFSET,		/* s64, ns */
+	VMMCI_ATTR_DELAY,		/* s64, ns */
+	VMMCI_ATTR_FREQ_PPB,		/* s64 */
+	__VMMCI_ATTR_MAX,
+};
+#define VMMCI_ATTR_MAX (__VMMCI_ATTR_MAX - 1)
+
+#ifndef __KERNEL__
+/* Copies a consistent snapshot of the time page into *out. */
+static inline void vmmci_time_page_read(const volatile struct vmmci_time_page *page,
+					struct vmmci_time_page *out)
+{
+	__u32 seq;
+
+	do {
+		while ((seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+		*out = *(const struct vmmci_time_page *) page;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) != seq);
+}
+#endif
+
+#endif // _VIRTIO_VMMCI_UAPI_H